@@ -0,0 +1,146 @@
+/*******************************************************************************
+copy_benchmark.cpp
+
+Usage: copy_benchmark [n ...]
+Time copies of random unrooted binary trees and forests with n leaves, as
+made for each branch of the TBR search. Defaults to 50, 200 and 1000
+leaves.
+
+Copyright 2018 Chris Whidden
+cwhidden@fredhutch.org
+https://github.com/cwhidden/uspr
+May 1, 2018
+Version 1.0.1
+
+This file is part of uspr.
+
+uspr is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+uspr is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with uspr.  If not, see <http://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+// includes
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include "utree.h"
+#include "unode.h"
+#include "uforest.h"
+#include "uspr_walk.h"
+
+using namespace std;
+
+// constants
+//
+// node copies timed for each tree size
+const long NODE_COPIES = 20000000;
+const unsigned int SEED = 1;
+// copies alive at once
+const size_t DEPTH = 8;
+
+// function prototypes
+double time_copies(uforest &F, long copies);
+double time_assignments(uforest &F, long copies);
+
+int main(int argc, char *argv[]) {
+	vector<int> sizes = vector<int>();
+	for (int i = 1; i < argc; i++) {
+		int n = atoi(argv[i]);
+		if (n < 4) {
+			cerr << "skipping " << argv[i] << ", trees need at least 4 leaves" << endl;
+			continue;
+		}
+		sizes.push_back(n);
+	}
+	if (argc <= 1) {
+		sizes.push_back(50);
+		sizes.push_back(200);
+		sizes.push_back(1000);
+	}
+
+	mt19937 generator = mt19937(SEED);
+	cout << "leaves\ttree_ns\tforest_ns\treused_ns" << endl;
+	for (int n : sizes) {
+		map<string, int> label_map = map<string, int>();
+		map<int, string> reverse_label_map = map<int, string>();
+		string T_line = random_tree(n, generator);
+		uforest T = uforest(T_line, &label_map, &reverse_label_map);
+		T.normalize_order();
+		long copies = NODE_COPIES / (2 * n);
+
+		// a forest from cutting a tenth of the edges, as in the search
+		uforest F = uforest(T);
+		distances_from_leaf_decorator(F, F.get_smallest_leaf());
+		for (int i = 0; i < n / 10; i++) {
+			unode *x = F.get_leaf(random_index(n, generator));
+			if (x->get_num_neighbors() > 0) {
+				F.cut_edge(x->get_label(), x->get_parent()->get_label());
+			}
+		}
+
+		cout << n << "\t" << time_copies(T, copies) << "\t"
+				<< time_copies(F, copies) << "\t"
+				<< time_assignments(F, copies) << endl;
+	}
+	return 0;
+}
+
+// nanoseconds for each copy of F, including its destruction
+// copies are made from copies and kept alive DEPTH at a time, as the
+// branches of the search copy the forests of their parents
+double time_copies(uforest &F, long copies) {
+	long check = 0;
+	vector<uforest *> stack = vector<uforest *>();
+	stack.push_back(&F);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (long i = 0; i < copies; i++) {
+		if (stack.size() > DEPTH) {
+			while (stack.size() > 1) {
+				delete stack.back();
+				stack.pop_back();
+			}
+		}
+		stack.push_back(new uforest(*stack.back()));
+		check += stack.back()->num_components();
+	}
+	while (stack.size() > 1) {
+		delete stack.back();
+		stack.pop_back();
+	}
+	chrono::steady_clock::time_point end = chrono::steady_clock::now();
+	if (check != copies * F.num_components()) {
+		cerr << "copies do not match" << endl;
+	}
+	return chrono::duration<double, nano>(end - start).count() / copies;
+}
+
+// nanoseconds for each assignment of F into forests that are reused, as
+// the TBR search does for each level of its branching
+double time_assignments(uforest &F, long copies) {
+	long check = 0;
+	vector<uforest> levels = vector<uforest>(DEPTH, F);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (long i = 0; i < copies; i++) {
+		int level = i % DEPTH;
+		levels[level] = (level == 0) ? F : levels[level - 1];
+		check += levels[level].num_components();
+	}
+	chrono::steady_clock::time_point end = chrono::steady_clock::now();
+	if (check != copies * F.num_components()) {
+		cerr << "copies do not match" << endl;
+	}
+	return chrono::duration<double, nano>(end - start).count() / copies;
+}
@@ -0,0 +1,274 @@
+/*******************************************************************************
+fingerprint.h
+
+Canonical tree fingerprints and a compact set of visited fingerprints
+
+Copyright 2018 Chris Whidden
+cwhidden@fredhutch.org
+https://github.com/cwhidden/uspr
+May 1, 2018
+Version 1.0.1
+
+This file is part of uspr.
+
+uspr is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+uspr is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with uspr.  If not, see <http://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+#ifndef INCLUDE_FINGERPRINT
+#define INCLUDE_FINGERPRINT
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// 128-bit fingerprint of an unrooted topology
+// a tree is identified by its set of splits, so the fingerprint is a sum
+// of split hashes. Each split is the set of leaves on the side of an edge
+// away from the smallest leaf, hashed as a sum of per-leaf keys.
+// The value does not depend on child order or internal labels
+class tree_fingerprint {
+	public:
+	uint64_t high;
+	uint64_t low;
+
+	tree_fingerprint() {
+		high = 0;
+		low = 0;
+	}
+	tree_fingerprint(uint64_t h, uint64_t l) {
+		high = h;
+		low = l;
+	}
+
+	bool empty() const {
+		return high == 0 && low == 0;
+	}
+
+	void add(const tree_fingerprint &f) {
+		high += f.high;
+		low += f.low;
+	}
+
+	void subtract(const tree_fingerprint &f) {
+		high -= f.high;
+		low -= f.low;
+	}
+
+	bool operator ==(const tree_fingerprint &f) const {
+		return high == f.high && low == f.low;
+	}
+	bool operator !=(const tree_fingerprint &f) const {
+		return high != f.high || low != f.low;
+	}
+	bool operator <(const tree_fingerprint &f) const {
+		if (high == f.high) {
+			return low < f.low;
+		}
+		return high < f.high;
+	}
+};
+
+// splitmix64 finalizer
+inline uint64_t fingerprint_mix(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// random key for a leaf, used to hash sets of leaves by summation
+inline tree_fingerprint leaf_fingerprint(int label) {
+	uint64_t l = (uint64_t)(int64_t)label;
+	return tree_fingerprint(fingerprint_mix(l ^ 0x5851f42d4c957f2dULL),
+			fingerprint_mix(l ^ 0x14057b7ef767814fULL));
+}
+
+// hash of one split given the sum of its leaf keys
+inline tree_fingerprint split_fingerprint(const tree_fingerprint &leaf_sum) {
+	return tree_fingerprint(fingerprint_mix(leaf_sum.high ^ 0xd1b54a32d192ed03ULL),
+			fingerprint_mix(leaf_sum.low ^ 0x8cb92ba72f3d8dd7ULL));
+}
+
+// open addressing hash set of fingerprints
+// two trees are treated as equal when all 128 bits of their fingerprints
+// match; this stores 16 bytes per tree rather than a newick string
+class fingerprint_set {
+	private:
+	vector<tree_fingerprint> slots;
+	size_t num_entries;
+	size_t mask;
+
+	size_t find_slot(const tree_fingerprint &f) const {
+		size_t i = f.low & mask;
+		while (!slots[i].empty() && slots[i] != f) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	void grow() {
+		vector<tree_fingerprint> old_slots = vector<tree_fingerprint>();
+		old_slots.swap(slots);
+		slots = vector<tree_fingerprint>(old_slots.size() * 2);
+		mask = slots.size() - 1;
+		for (tree_fingerprint &f : old_slots) {
+			if (!f.empty()) {
+				slots[find_slot(f)] = f;
+			}
+		}
+	}
+
+	// the zero fingerprint marks empty slots
+	static tree_fingerprint key(const tree_fingerprint &f) {
+		if (f.empty()) {
+			return tree_fingerprint(0, 1);
+		}
+		return f;
+	}
+
+	public:
+	fingerprint_set(size_t initial_size = 1024) {
+		size_t size = 16;
+		while (size < initial_size) {
+			size *= 2;
+		}
+		slots = vector<tree_fingerprint>(size);
+		num_entries = 0;
+		mask = size - 1;
+	}
+
+	// returns true if f was not already in the set
+	bool insert(const tree_fingerprint &f) {
+		tree_fingerprint k = key(f);
+		size_t i = find_slot(k);
+		if (!slots[i].empty()) {
+			return false;
+		}
+		slots[i] = k;
+		num_entries++;
+		if (num_entries * 10 > slots.size() * 7) {
+			grow();
+		}
+		return true;
+	}
+
+	bool contains(const tree_fingerprint &f) const {
+		return !slots[find_slot(key(f))].empty();
+	}
+
+	size_t size() const {
+		return num_entries;
+	}
+
+	void clear() {
+		slots.assign(slots.size(), tree_fingerprint());
+		num_entries = 0;
+	}
+};
+
+// open addressing hash map from fingerprints to the lowest cost seen
+class fingerprint_map {
+	private:
+	vector<tree_fingerprint> slots;
+	vector<int> values;
+	size_t num_entries;
+	size_t mask;
+
+	size_t find_slot(const tree_fingerprint &f) const {
+		size_t i = f.low & mask;
+		while (!slots[i].empty() && slots[i] != f) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	void grow() {
+		vector<tree_fingerprint> old_slots = vector<tree_fingerprint>();
+		vector<int> old_values = vector<int>();
+		old_slots.swap(slots);
+		old_values.swap(values);
+		slots = vector<tree_fingerprint>(old_slots.size() * 2);
+		values = vector<int>(old_slots.size() * 2);
+		mask = slots.size() - 1;
+		for (size_t i = 0; i < old_slots.size(); i++) {
+			if (!old_slots[i].empty()) {
+				size_t j = find_slot(old_slots[i]);
+				slots[j] = old_slots[i];
+				values[j] = old_values[i];
+			}
+		}
+	}
+
+	static tree_fingerprint key(const tree_fingerprint &f) {
+		if (f.empty()) {
+			return tree_fingerprint(0, 1);
+		}
+		return f;
+	}
+
+	public:
+	fingerprint_map(size_t initial_size = 1024) {
+		size_t size = 16;
+		while (size < initial_size) {
+			size *= 2;
+		}
+		slots = vector<tree_fingerprint>(size);
+		values = vector<int>(size);
+		num_entries = 0;
+		mask = size - 1;
+	}
+
+	// store value for f if f is new or value is lower than the stored value
+	// returns true if the map changed
+	bool insert_min(const tree_fingerprint &f, int value) {
+		tree_fingerprint k = key(f);
+		size_t i = find_slot(k);
+		if (!slots[i].empty()) {
+			if (value < values[i]) {
+				values[i] = value;
+				return true;
+			}
+			return false;
+		}
+		slots[i] = k;
+		values[i] = value;
+		num_entries++;
+		if (num_entries * 10 > slots.size() * 7) {
+			grow();
+		}
+		return true;
+	}
+
+	void clear() {
+		slots.assign(slots.size(), tree_fingerprint());
+		num_entries = 0;
+	}
+
+	// returns the stored value or -1 if f is not in the map
+	int get(const tree_fingerprint &f) const {
+		size_t i = find_slot(key(f));
+		if (slots[i].empty()) {
+			return -1;
+		}
+		return values[i];
+	}
+
+	size_t size() const {
+		return num_entries;
+	}
+};
+
+#endif
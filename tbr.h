@@ -91,10 +91,14 @@ typedef boost::adjacency_list <boost::vecS, boost::vecS, boost::undirectedS, boo
 
 
 // NOTE: okay for TBR distance only, not for all mAFs / replug
-bool OPTIMIZE_2B = false;
+// thread local as tbr_distance enables it temporarily
+thread_local bool OPTIMIZE_2B = false;
 bool OPTIMIZE_PROTECT_A = true;
 bool OPTIMIZE_PROTECT_B = false;
 bool OPTIMIZE_BRANCH_AND_BOUND = true;
+// branch by changing the search state in place and undoing the changes
+// with a tbr_trail rather than copying the state for each branch
+bool TBR_UNDO_TRAIL = false;
 
 // classes
 
@@ -133,8 +137,354 @@ class nodemapping {
 				return -1;
 			}
 		}
+		// set one direction of the mapping, or remove it with -1
+		void set_forward(int l1, int l2) {
+			forward.erase(l1);
+			if (l2 != -1) {
+				forward.insert(make_pair(l1, l2));
+			}
+		}
+		void set_backward(int l2, int l1) {
+			backward.erase(l2);
+			if (l1 != -1) {
+				backward.insert(make_pair(l2, l1));
+			}
+		}
+};
+
+// changes logged by a tbr_trail
+// the fields of a node that edge cuts, contractions and protection change
+class tbr_node_change {
+	public:
+	unode *n;
+	neighbor_list neighbors;
+	neighbor_list contracted_neighbors;
+	int component;
+	bool terminal;
+	int distance;
+	bool b_protected;
+
+	tbr_node_change(unode *n) : n(n), neighbors(n->const_neighbors()), contracted_neighbors(n->const_contracted_neighbors()) {
+		component = n->get_component();
+		terminal = n->get_terminal();
+		distance = n->get_distance();
+		b_protected = n->is_protected();
+	}
+
+	void restore() {
+		n->set_neighbors(neighbors, contracted_neighbors);
+		n->set_component(component);
+		n->set_terminal(terminal);
+		n->set_distance(distance);
+		n->set_protected(b_protected);
+	}
+};
+
+// an entry of a forest's components, or with a NULL root its number of
+// components
+class tbr_component_change {
+	public:
+	uforest *F;
+	int c;
+	unode *root;
+
+	tbr_component_change(uforest *F, int c, unode *root) : F(F), c(c), root(root) {
+	}
+};
+
+// the twin of a label in one direction of a mapping, -1 for none
+class tbr_twin_change {
+	public:
+	nodemapping *twins;
+	bool forward;
+	int label;
+	int twin;
+
+	tbr_twin_change(nodemapping *twins, bool forward, int label, int twin) : twins(twins), forward(forward), label(label), twin(twin) {
+	}
+};
+
+// the sibling of a label, -1 for none
+class tbr_sibling_change {
+	public:
+	map<int, int> *sibling_pairs;
+	int label;
+	int sibling;
+
+	tbr_sibling_change(map<int, int> *sibling_pairs, int label, int sibling) : sibling_pairs(sibling_pairs), label(label), sibling(sibling) {
+	}
+};
+
+// a singleton popped from the front, or with -1 one pushed on the back
+class tbr_singleton_change {
+	public:
+	list<int> *singletons;
+	int label;
+
+	tbr_singleton_change(list<int> *singletons, int label) : singletons(singletons), label(label) {
+	}
+};
+
+// a point in a tbr_trail to undo back to
+class tbr_trail_mark {
+	public:
+	size_t nodes;
+	size_t components;
+	size_t twins;
+	size_t sibling_pairs;
+	size_t singletons;
+};
+
+// a log of the changes tbr_distance_hlpr makes to its search state, so
+// that each branch can change its parent's state in place and undo the
+// changes afterwards rather than copying the state. Each change is saved
+// just before it is made: the fields of each node that an edge cut or
+// contraction may touch, the component entries those nodes refer to, and
+// the old values of changed twins, sibling pairs and singletons. Undoing
+// restores them in reverse, so a branch costs time in the size of its
+// changes rather than the size of the forests. A trail that is not
+// recording ignores all of this
+class tbr_trail {
+	private:
+	bool recording;
+	vector<tbr_node_change> nodes;
+	vector<tbr_component_change> components;
+	vector<tbr_twin_change> twins;
+	vector<tbr_sibling_change> sibling_pairs;
+	vector<tbr_singleton_change> singletons;
+
+	public:
+	tbr_trail(bool record) {
+		recording = record;
+		nodes = vector<tbr_node_change>();
+		components = vector<tbr_component_change>();
+		twins = vector<tbr_twin_change>();
+		sibling_pairs = vector<tbr_sibling_change>();
+		singletons = vector<tbr_singleton_change>();
+	}
+
+	bool is_recording() {
+		return recording;
+	}
+
+	tbr_trail_mark mark() {
+		tbr_trail_mark m;
+		m.nodes = nodes.size();
+		m.components = components.size();
+		m.twins = twins.size();
+		m.sibling_pairs = sibling_pairs.size();
+		m.singletons = singletons.size();
+		return m;
+	}
+
+	// save a node of F and the component it represents
+	void save_node(uforest &F, unode *n) {
+		if (!recording) {
+			return;
+		}
+		nodes.push_back(tbr_node_change(n));
+		int c = n->get_component();
+		if (c > -1) {
+			components.push_back(tbr_component_change(&F, c, F.get_component(c)));
+		}
+	}
+
+	// save the nodes and components of F that cutting (x, y) may change
+	// cut_edge only changes x, y and their neighbors when contracting them
+	void save_edge(uforest &F, int x, int y) {
+		if (!recording) {
+			return;
+		}
+		components.push_back(tbr_component_change(&F, F.num_components(), NULL));
+		save_neighborhood(F, F.get_node(x));
+		save_neighborhood(F, F.get_node(y));
+	}
+
+	// save the entries twins.add(l1, l2) replaces
+	void save_twins(nodemapping &twins, int l1, int l2) {
+		if (!recording) {
+			return;
+		}
+		this->twins.push_back(tbr_twin_change(&twins, true, l1, twins.get_forward(l1)));
+		this->twins.push_back(tbr_twin_change(&twins, false, l2, twins.get_backward(l2)));
+	}
+
+	// save the sibling of a label before it is inserted or erased
+	void save_sibling_pair(map<int, int> &sibling_pairs, int label) {
+		if (!recording) {
+			return;
+		}
+		map<int, int>::iterator i = sibling_pairs.find(label);
+		int sibling = (i == sibling_pairs.end()) ? -1 : i->second;
+		this->sibling_pairs.push_back(tbr_sibling_change(&sibling_pairs, label, sibling));
+	}
+
+	void save_singletons_pop(list<int> &singletons) {
+		if (!recording) {
+			return;
+		}
+		this->singletons.push_back(tbr_singleton_change(&singletons, singletons.front()));
+	}
+
+	void save_singletons_push(list<int> &singletons) {
+		if (!recording) {
+			return;
+		}
+		this->singletons.push_back(tbr_singleton_change(&singletons, -1));
+	}
+
+	// restore everything saved since the mark
+	void undo(const tbr_trail_mark &m) {
+		if (!recording) {
+			return;
+		}
+		while (nodes.size() > m.nodes) {
+			nodes.back().restore();
+			nodes.pop_back();
+		}
+		while (components.size() > m.components) {
+			tbr_component_change &change = components.back();
+			if (change.root == NULL) {
+				change.F->remove_components_after(change.c);
+			}
+			else {
+				change.F->update_component(change.c, change.root);
+			}
+			components.pop_back();
+		}
+		while (twins.size() > m.twins) {
+			tbr_twin_change &change = twins.back();
+			if (change.forward) {
+				change.twins->set_forward(change.label, change.twin);
+			}
+			else {
+				change.twins->set_backward(change.label, change.twin);
+			}
+			twins.pop_back();
+		}
+		while (sibling_pairs.size() > m.sibling_pairs) {
+			tbr_sibling_change &change = sibling_pairs.back();
+			change.sibling_pairs->erase(change.label);
+			if (change.sibling != -1) {
+				change.sibling_pairs->insert(make_pair(change.label, change.sibling));
+			}
+			sibling_pairs.pop_back();
+		}
+		while (singletons.size() > m.singletons) {
+			tbr_singleton_change &change = singletons.back();
+			if (change.label == -1) {
+				change.singletons->pop_back();
+			}
+			else {
+				change.singletons->push_front(change.label);
+			}
+			singletons.pop_back();
+		}
+	}
+
+	private:
+	void save_neighborhood(uforest &F, unode *n) {
+		save_node(F, n);
+		for (unode *u : n->get_neighbors()) {
+			save_node(F, u);
+		}
+		for (unode *u : n->get_contracted_neighbors()) {
+			save_node(F, u);
+		}
+	}
+};
+
+// copies of the search state made for the branches of tbr_distance_hlpr
+class tbr_branch_state {
+	public:
+	uforest F1;
+	uforest F2;
+	nodemapping twins;
+	map<int, int> sibling_pairs;
+	list<int> singletons;
+
+	tbr_branch_state(uforest &F1, uforest &F2, nodemapping &twins, map<int, int> &sibling_pairs, list<int> &singletons) : F1(F1), F2(F2), twins(twins), sibling_pairs(sibling_pairs), singletons(singletons) {
+	}
 };
 
+// the state a branch of tbr_distance_hlpr works on: the arena's copy of
+// its parent's state or, when a trail is recording, the parent's state
+// itself, to be undone back to the mark
+class tbr_branch {
+	public:
+	uforest &F1;
+	uforest &F2;
+	nodemapping &twins;
+	map<int, int> &sibling_pairs;
+	list<int> &singletons;
+	tbr_trail_mark mark;
+
+	tbr_branch(uforest &F1, uforest &F2, nodemapping &twins, map<int, int> &sibling_pairs, list<int> &singletons, tbr_trail_mark mark) : F1(F1), F2(F2), twins(twins), sibling_pairs(sibling_pairs), singletons(singletons), mark(mark) {
+	}
+};
+
+// per-thread storage for the branches of tbr_distance_hlpr, one state for
+// each level of the recursion. Each branch assigns its parent's state
+// into the state of its level, which keeps the memory of the forests,
+// mappings and worklists, so once a level has been reached its branches
+// copy without going through the allocator
+class tbr_search_arena {
+	private:
+	vector<tbr_branch_state *> levels;
+	int depth;
+
+	public:
+	tbr_search_arena() {
+		levels = vector<tbr_branch_state *>();
+		depth = 0;
+	}
+	~tbr_search_arena() {
+		for (tbr_branch_state *s : levels) {
+			delete s;
+		}
+	}
+
+	// start a level of branching and return it
+	int enter() {
+		return depth++;
+	}
+
+	// the branches of the level are done with its state
+	void leave() {
+		depth--;
+	}
+
+	// copy a state into the storage of the level
+	tbr_branch_state &copy(int level, uforest &F1, uforest &F2, nodemapping &twins, map<int, int> &sibling_pairs, list<int> &singletons) {
+		if ((size_t)level >= levels.size()) {
+			levels.resize(level + 1, NULL);
+		}
+		if (levels[level] == NULL) {
+			levels[level] = new tbr_branch_state(F1, F2, twins, sibling_pairs, singletons);
+		}
+		else {
+			tbr_branch_state &s = *levels[level];
+			s.F1 = F1;
+			s.F2 = F2;
+			s.twins = twins;
+			s.sibling_pairs = sibling_pairs;
+			s.singletons = singletons;
+		}
+		return *levels[level];
+	}
+
+	// the state for a branch of the level
+	tbr_branch branch(int level, uforest &F1, uforest &F2, nodemapping &twins, map<int, int> &sibling_pairs, list<int> &singletons, tbr_trail &trail) {
+		if (trail.is_recording()) {
+			return tbr_branch(F1, F2, twins, sibling_pairs, singletons, trail.mark());
+		}
+		tbr_branch_state &s = copy(level, F1, F2, twins, sibling_pairs, singletons);
+		return tbr_branch(s.F1, s.F2, s.twins, s.sibling_pairs, s.singletons, trail.mark());
+	}
+};
+
+thread_local tbr_search_arena TBR_ARENA;
+
 class socket {
 	public:
 	socket(int x, int y, int c, int n) {
@@ -230,8 +580,12 @@ int tbr_distance(uforest &T1, uforest &T2, T t, int (*func_pointer)(uforest &F1,
 template<typename T>
 int tbr_distance_hlpr(uforest &T1, uforest &T2, int k, T t, int (*func_pointer)(uforest &F1, uforest &F2, nodemapping &twins, int k, T s), uforest **MAF1 = NULL, uforest **MAF2 = NULL);
 template<typename T>
-int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<int, int> &sibling_pairs, list<int> &singletons, T t, int (*func_pointer)(uforest &F1, uforest &F2, nodemapping &twins, int k, T s), uforest **MAF1 = NULL, uforest **MAF2 = NULL);
+int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<int, int> &sibling_pairs, list<int> &singletons, tbr_trail &trail, T t, int (*func_pointer)(uforest &F1, uforest &F2, nodemapping &twins, int k, T s), uforest **MAF1 = NULL, uforest **MAF2 = NULL);
 int replug_distance(uforest &T1, uforest &T2, bool quiet = true, uforest **MAF1_out = NULL, uforest **MAF2_out = NULL);
+int tbr_distance_range(uforest &T1, uforest &T2, int lower_bound, int upper_bound);
+int replug_distance_range(uforest &T1, uforest &T2, int lower_bound, int upper_bound);
+template <typename T>
+int tbr_distance_range(uforest &T1, uforest &T2, T t, int (*func_pointer)(uforest &F1, uforest &F2, nodemapping &twins, int k, T s), int lower_bound, int upper_bound);
 list<pair<int,int> > find_pendants(unode *a, unode *c);
 int tbr_approx(uforest &T1, uforest &T2);
 int tbr_approx(uforest &T1, uforest &T2, bool low);
@@ -247,7 +601,7 @@ bool get_path(unode *xstart, unode *ystart, list<unode *> &path);
 void add_sockets(unode *x, unode *y, list<socket *> &sockets);
 void find_dead_components(uforest &T, socketcontainer &S, map<int, nodestatus> &T_status, vector<list<int> > &T_dead_components);
 void find_dead_components_hlpr(unode *n, unode *prev, int component, uforest &T, socketcontainer &S, map<int, nodestatus> &T_status, vector<list<int> > &T_dead_components);
-void update_nodemapping(nodemapping &twins, uforest &F, int original_label, int new_label, bool forward);
+void update_nodemapping(nodemapping &twins, uforest &F, int original_label, int new_label, bool forward, tbr_trail *trail = NULL);
 int check_socket_group_combination(int k, int kprime, socketcontainer &T1_sockets, socketcontainer &T2_sockets_normalized, vector<list<int> > &T1_dead_components, vector<list<int> > &T2_dead_components, vector<pair<vector<socket *> , vector<socket *> > > &socketcandidates, vector<pair<socket *, socket *> > &sockets, vector<pair<socket *, socket *> > &candidate_phi_node_sockets);
 int check_socket_group_combinations(int n, int i, int j, int last, int k, int kprime, socketcontainer &T1_sockets, socketcontainer &T2_sockets_normalized, vector<list<int> > &T1_dead_components, vector<list<int> > &T2_dead_components, vector<pair<vector<socket *> , vector<socket *> > > &socketcandidates, vector<pair<socket *, socket *> > &sockets, vector<pair<socket *, socket *> > &phi_node_sockets);
 int check_socket_group_combinations(int k, int kprime, socketcontainer &T1_sockets, socketcontainer &T2_sockets_normalized, vector<list<int> > &T1_dead_components, vector<list<int> > &T2_dead_components, vector<pair<vector<socket *> , vector<socket *> > > &socketcandidates, vector<pair<socket *, socket *> > &phi_node_sockets);
@@ -413,6 +767,42 @@ int replug_distance(uforest &T1, uforest &T2, bool quiet /* = true */, uforest *
 	return d;
 }
 
+// compute the TBR distance when it is known to be in
+// [lower_bound, upper_bound], e.g. from a neighbor one SPR away.
+// Only the values below upper_bound are tested, so upper_bound is
+// returned without a search when none of them are feasible
+int tbr_distance_range(uforest &T1, uforest &T2, int lower_bound, int upper_bound) {
+	bool old_value = OPTIMIZE_2B;
+	// always safe for the TBR distance
+	OPTIMIZE_2B = true;
+	int d = tbr_distance_range(T1, T2, 0, &dummy_mAFs, lower_bound, upper_bound);
+	OPTIMIZE_2B = old_value;
+	return d;
+}
+
+// compute the replug distance when it is known to be in
+// [lower_bound, upper_bound]
+int replug_distance_range(uforest &T1, uforest &T2, int lower_bound, int upper_bound) {
+	// may be needed
+	T1.root(T1.get_smallest_leaf());
+	T2.root(T2.get_smallest_leaf());
+	distances_from_leaf_decorator(T1, T1.get_smallest_leaf());
+	distances_from_leaf_decorator(T2, T2.get_smallest_leaf());
+	return tbr_distance_range(T1, T2, make_pair(T1, T2), &replug_hlpr, lower_bound, upper_bound);
+}
+
+template <typename T>
+int tbr_distance_range(uforest &T1, uforest &T2, T t, int (*func_pointer)(uforest &F1, uforest &F2, nodemapping &twins, int k, T s), int lower_bound, int upper_bound) {
+	for(int k = lower_bound; k < upper_bound; k++) {
+		// test k
+		int result = tbr_distance_hlpr(T1, T2, k, t, func_pointer);
+		if (result >= 0) {
+			return k - result;
+		}
+	}
+	return upper_bound;
+}
+
 template <typename T>
 int tbr_distance_hlpr(uforest &T1, uforest &T2, int k, T t, int (*func_pointer)(uforest &F1, uforest &F2, nodemapping &twins, int k, T s), uforest **MAF1 /* = NULL */, uforest **MAF2 /* = NULL */) {
 	uforest F1 = uforest(T1);
@@ -460,11 +850,12 @@ int tbr_distance_hlpr(uforest &T1, uforest &T2, int k, T t, int (*func_pointer)(
 	)
 
 
-	return tbr_distance_hlpr(F1, F2, k, twins, sibling_pairs, singletons, t, func_pointer, MAF1, MAF2);
+	tbr_trail trail = tbr_trail(TBR_UNDO_TRAIL);
+	return tbr_distance_hlpr(F1, F2, k, twins, sibling_pairs, singletons, trail, t, func_pointer, MAF1, MAF2);
 }
 
 template <typename T>
-int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<int, int> &sibling_pairs, list<int> &singletons, T t, int (*func_pointer)(uforest &F1, uforest &F2, nodemapping &twins, int k, T s), uforest **MAF1 /* = NULL*/, uforest **MAF2 /* = NULL*/) {
+int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<int, int> &sibling_pairs, list<int> &singletons, tbr_trail &trail, T t, int (*func_pointer)(uforest &F1, uforest &F2, nodemapping &twins, int k, T s), uforest **MAF1 /* = NULL*/, uforest **MAF2 /* = NULL*/) {
 
 	if (k < 0) {
 		return -1;
@@ -481,6 +872,7 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 			debug(cout << "Case 1" << endl);
 
 			unode *F2_a = F2.get_node(singletons.front());
+			trail.save_singletons_pop(singletons);
 			singletons.pop_front();
 			unode *F1_a = F1.get_node(twins.get_backward(F2_a->get_label()));
 			debug(
@@ -497,8 +889,10 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 			if (spi != sibling_pairs.end()) {
 //				j = sibling_pairs.find(i->second);
 //				if (j != sibling_pairs.end() && j->second == i->first) {
+					trail.save_sibling_pair(sibling_pairs, spi->second);
 					sibling_pairs.erase(spi->second);
 //				}
+				trail.save_sibling_pair(sibling_pairs, spi->first);
 				sibling_pairs.erase(spi->first);
 			}
 
@@ -509,9 +903,10 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 			}
 			int first_label = F1_a->get_label();
 			int second_label = F1_a->get_parent()->get_label();
+			trail.save_edge(F1, first_label, second_label);
 			pair<int,int> components = F1.cut_edge(first_label, second_label);
-			update_nodemapping(twins, F1, first_label, components.first, true);
-			update_nodemapping(twins, F1, second_label, components.second, true);
+			update_nodemapping(twins, F1, first_label, components.first, true, &trail);
+			update_nodemapping(twins, F1, second_label, components.second, true, &trail);
 
 			debug(cout << F1 << endl);
 
@@ -539,6 +934,8 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 			if (i >= 2) {
 				if (sibling_pairs.find(new_sibling_pair[i-1]) == sibling_pairs.end() && sibling_pairs.find(new_sibling_pair[i-2]) == sibling_pairs.end()) {
 					debug(cout << "sibling_pair found" << endl);
+					trail.save_sibling_pair(sibling_pairs, new_sibling_pair[i-2]);
+					trail.save_sibling_pair(sibling_pairs, new_sibling_pair[i-1]);
 					sibling_pairs.insert(make_pair(new_sibling_pair[i-2], new_sibling_pair[i-1]));
 					sibling_pairs.insert(make_pair(new_sibling_pair[i-1], new_sibling_pair[i-2]));
 				}
@@ -561,7 +958,9 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 		map<int, int>::iterator spi = sibling_pairs.begin();
 		unode *F1_a = F1.get_node(spi->first);
 		unode *F1_c = F1.get_node(spi->second);
+		trail.save_sibling_pair(sibling_pairs, F1_a->get_label());
 		sibling_pairs.erase(F1_a->get_label());
+		trail.save_sibling_pair(sibling_pairs, F1_c->get_label());
 		sibling_pairs.erase(F1_c->get_label());
 
 		// find a and c in F2
@@ -610,6 +1009,9 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 			// contract F1_a and F1_c
 			unode *F1_new_terminal = F1_a->get_parent();
 			debug(cout << "F1_new_terminal: " << F1.str_subtree(F1_new_terminal) << endl);
+			trail.save_node(F1, F1_new_terminal);
+			trail.save_node(F1, F1_a);
+			trail.save_node(F1, F1_c);
 			F1_new_terminal->set_terminal(true);
 			F1_new_terminal->contract_neighbor(F1_a);
 			F1_new_terminal->contract_neighbor(F1_c);
@@ -639,6 +1041,8 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 			int i = new_sibling_pair.size();
 			if (i >= 2) {
 				if (sibling_pairs.find(new_sibling_pair[i-1]) == sibling_pairs.end() && sibling_pairs.find(new_sibling_pair[i-2]) == sibling_pairs.end()) {
+					trail.save_sibling_pair(sibling_pairs, new_sibling_pair[i-1]);
+					trail.save_sibling_pair(sibling_pairs, new_sibling_pair[i-2]);
 					sibling_pairs.insert(make_pair(new_sibling_pair[i-1], new_sibling_pair[i-2]));
 					sibling_pairs.insert(make_pair(new_sibling_pair[i-2], new_sibling_pair[i-1]));
 				}
@@ -655,6 +1059,9 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 					F2_a->get_label() < -1) {
 				F2_new_terminal = F2_a;
 			}
+			trail.save_node(F2, F2_new_terminal);
+			trail.save_node(F2, F2_a);
+			trail.save_node(F2, F2_c);
 			F2_new_terminal->set_terminal(true);
 
 			if (F2_new_terminal != F2_a) {
@@ -676,10 +1083,12 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 			}
 
 			// add to nodemapping
+			trail.save_twins(twins, F1_new_terminal->get_label(), F2_new_terminal->get_label());
 			twins.add(F1_new_terminal->get_label(), F2_new_terminal->get_label());
 
 			// check for singleton
 			if (F2_new_terminal->is_singleton()) { //get_parent()->get_distance() > F2_new_terminal->get_distance()) 
+				trail.save_singletons_push(singletons);
 				singletons.push_back(F2_new_terminal->get_label());
 			}
 
@@ -712,6 +1121,7 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 			}
 
 			int result = -1;
+			int level = TBR_ARENA.enter();
 
 			// find pendant edges between a and c in F2
 			// TODO: need distances from "root" to do this efficiently
@@ -764,21 +1174,23 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 	
 				debug(cout  << "cut e_a" << endl);
 	
-				// copy the trees
-				uforest F1_copy = uforest(F1);
-				uforest F2_copy = uforest(F2);
+				// copy the trees, or change them in place and undo it after
+				tbr_branch copy = TBR_ARENA.branch(level, F1, F2, twins, sibling_pairs, singletons, trail);
+				uforest &F1_copy = copy.F1;
+				uforest &F2_copy = copy.F2;
 				uforest *MAF1_copy = NULL;
 				uforest *MAF2_copy = NULL;
-				nodemapping twins_copy = nodemapping(twins);
-				map<int,int> sibling_pairs_copy = map<int, int>(sibling_pairs);
-				list<int> singletons_copy = list<int>(singletons);
+				nodemapping &twins_copy = copy.twins;
+				map<int, int> &sibling_pairs_copy = copy.sibling_pairs;
+				list<int> &singletons_copy = copy.singletons;
 	
 				debug(cout << F2_copy << endl);
 				int first_label = e_a.first;
 				int second_label = e_a.second;
+				trail.save_edge(F2_copy, first_label, second_label);
 				pair<int,int> components = F2_copy.cut_edge(first_label, second_label);
-				update_nodemapping(twins_copy, F2_copy, first_label, components.first, false);
-				update_nodemapping(twins_copy, F2_copy, second_label, components.second, false);
+				update_nodemapping(twins_copy, F2_copy, first_label, components.first, false, &trail);
+				update_nodemapping(twins_copy, F2_copy, second_label, components.second, false, &trail);
 				debug(
 					cout << F2_copy << endl;
 					cout << components.first << endl;
@@ -790,14 +1202,17 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 				debug(cout << "checking if " << F2_copy.str_subtree(F2_copy.get_node(components.first)) << " is a singleton" << endl);
 				if (F2_copy.get_node(components.first)->is_singleton()) {
 					debug(cout << "it is" << endl);
+					trail.save_singletons_push(singletons_copy);
 					singletons_copy.push_back(components.first);
 				}
 				debug(cout << "checking if " << F2_copy.str_subtree(F2_copy.get_node(components.second)) << " is a singleton" << endl);
 				if (F2_copy.get_node(components.second)->is_singleton()) {
 					debug(cout << "it is" << endl);
+					trail.save_singletons_push(singletons_copy);
 					singletons_copy.push_back(components.second);
 				}
-				int branch_a = tbr_distance_hlpr(F1_copy, F2_copy, k-1, twins_copy, sibling_pairs_copy, singletons_copy, t, func_pointer, &MAF1_copy, &MAF2_copy);
+				int branch_a = tbr_distance_hlpr(F1_copy, F2_copy, k-1, twins_copy, sibling_pairs_copy, singletons_copy, trail, t, func_pointer, &MAF1_copy, &MAF2_copy);
+				trail.undo(copy.mark);
 	
 				bool delete_copy = true;
 				if (branch_a > result) {
@@ -830,32 +1245,38 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 	
 				debug(cout  << "cut e_c: " << F2.str_subtree(F2_c) << endl);
 	
-				// copy the trees
-				uforest F1_copy = uforest(F1);
-				uforest F2_copy = uforest(F2);
+				// copy the trees, or change them in place and undo it after
+				tbr_branch copy = TBR_ARENA.branch(level, F1, F2, twins, sibling_pairs, singletons, trail);
+				uforest &F1_copy = copy.F1;
+				uforest &F2_copy = copy.F2;
 				uforest *MAF1_copy = NULL;
 				uforest *MAF2_copy = NULL;
-				nodemapping twins_copy = nodemapping(twins);
-				map<int, int> sibling_pairs_copy = map<int, int>(sibling_pairs);
-				list<int> singletons_copy = list<int>(singletons);
+				nodemapping &twins_copy = copy.twins;
+				map<int, int> &sibling_pairs_copy = copy.sibling_pairs;
+				list<int> &singletons_copy = copy.singletons;
 	
 				debug(cout << F2_copy << endl);
 				int first_label = e_c.first;
 				int second_label = e_c.second;
+				trail.save_edge(F2_copy, first_label, second_label);
 				pair<int,int> components = F2_copy.cut_edge(first_label, second_label);
-				update_nodemapping(twins_copy, F2_copy, first_label, components.first, false);
-				update_nodemapping(twins_copy, F2_copy, second_label, components.second, false);
+				update_nodemapping(twins_copy, F2_copy, first_label, components.first, false, &trail);
+				update_nodemapping(twins_copy, F2_copy, second_label, components.second, false, &trail);
 				if (OPTIMIZE_PROTECT_A) {
+					trail.save_node(F2_copy, F2_copy.get_node(F2_a->get_label()));
 					F2_copy.get_node(F2_a->get_label())->set_protected(true);
 				}
 				debug(cout << F2_copy << endl);
 				if (F2_copy.get_node(components.first)->is_singleton()) {
+					trail.save_singletons_push(singletons_copy);
 					singletons_copy.push_back(components.first);
 				}
 				if (F2_copy.get_node(components.second)->is_singleton()) {
+					trail.save_singletons_push(singletons_copy);
 					singletons_copy.push_back(components.second);
 				}
-				int branch_c = tbr_distance_hlpr(F1_copy, F2_copy, k-1, twins_copy, sibling_pairs_copy, singletons_copy, t, func_pointer, &MAF1_copy, &MAF2_copy);
+				int branch_c = tbr_distance_hlpr(F1_copy, F2_copy, k-1, twins_copy, sibling_pairs_copy, singletons_copy, trail, t, func_pointer, &MAF1_copy, &MAF2_copy);
+				trail.undo(copy.mark);
 	
 				bool delete_copy = true;
 				if (branch_c > result) {
@@ -889,16 +1310,19 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 					debug(cout << "cut e_b except for e_{b_" << i << "}" << endl);
 					bool valid = true;
 
-					// copy the trees
-					uforest F1_copy = uforest(F1);
-					uforest F2_copy = uforest(F2);
+					// copy the trees, or change them in place and undo it after
+					tbr_branch copy = TBR_ARENA.branch(level, F1, F2, twins, sibling_pairs, singletons, trail);
+					uforest &F1_copy = copy.F1;
+					uforest &F2_copy = copy.F2;
 					uforest *MAF1_copy = NULL;
 					uforest *MAF2_copy = NULL;
-					nodemapping twins_copy = nodemapping(twins);
-					map<int, int> sibling_pairs_copy = map<int, int>(sibling_pairs);
+					nodemapping &twins_copy = copy.twins;
+					map<int, int> &sibling_pairs_copy = copy.sibling_pairs;
+					trail.save_sibling_pair(sibling_pairs_copy, F1_a->get_label());
+					trail.save_sibling_pair(sibling_pairs_copy, F1_c->get_label());
 					sibling_pairs_copy.insert(make_pair(F1_a->get_label(), F1_c->get_label()));
 					sibling_pairs_copy.insert(make_pair(F1_c->get_label(), F1_a->get_label()));
-					list<int> singletons_copy = list<int>(singletons);
+					list<int> &singletons_copy = copy.singletons;
 
 					debug(cout << F2_copy << endl);
 
@@ -920,14 +1344,17 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 
 							int first_label = e_b.first;
 							int second_label = e_b.second;
+							trail.save_edge(F2_copy, first_label, second_label);
 							pair<int,int> components = F2_copy.cut_edge(first_label, second_label);
-							update_nodemapping(twins_copy, F2_copy, first_label, components.first, false);
-							update_nodemapping(twins_copy, F2_copy, second_label, components.second, false);
+							update_nodemapping(twins_copy, F2_copy, first_label, components.first, false, &trail);
+							update_nodemapping(twins_copy, F2_copy, second_label, components.second, false, &trail);
 							debug(cout << F2_copy << endl);
 							if (F2_copy.get_node(components.first)->is_singleton()) {
+								trail.save_singletons_push(singletons_copy);
 								singletons_copy.push_back(components.first);
 							}
 							if (F2_copy.get_node(components.second)->is_singleton()) {
+								trail.save_singletons_push(singletons_copy);
 								singletons_copy.push_back(components.second);
 							}
 						}
@@ -939,6 +1366,7 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 									x = F2_copy.get_node(e_b.second);
 									y = F2_copy.get_node(e_b.first);
 								}
+								trail.save_node(F2_copy, x);
 								x->set_protected(true);
 							}
 						}
@@ -946,8 +1374,9 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 					}
 					int branch_b = -1;
 					if (valid) {
-						branch_b = tbr_distance_hlpr(F1_copy, F2_copy, k-(num_pendants-1), twins_copy, sibling_pairs_copy, singletons_copy, t, func_pointer, &MAF1_copy, &MAF2_copy);
+						branch_b = tbr_distance_hlpr(F1_copy, F2_copy, k-(num_pendants-1), twins_copy, sibling_pairs_copy, singletons_copy, trail, t, func_pointer, &MAF1_copy, &MAF2_copy);
 					}
+					trail.undo(copy.mark);
 					bool delete_copy = true;
 					if (branch_b > result) {
 						if (MAF1 != NULL && MAF2 != NULL) {
@@ -980,31 +1409,38 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 	
 				debug(cout  << "cut e_b" << endl);
 	
-				// copy the trees
-				uforest F1_copy = uforest(F1);
-				uforest F2_copy = uforest(F2);
+				// copy the trees, or change them in place and undo it after
+				tbr_branch copy = TBR_ARENA.branch(level, F1, F2, twins, sibling_pairs, singletons, trail);
+				uforest &F1_copy = copy.F1;
+				uforest &F2_copy = copy.F2;
 				uforest *MAF1_copy = NULL;
 				uforest *MAF2_copy = NULL;
-				nodemapping twins_copy = nodemapping(twins);
-				map<int, int> sibling_pairs_copy = map<int, int>(sibling_pairs);
+				nodemapping &twins_copy = copy.twins;
+				map<int, int> &sibling_pairs_copy = copy.sibling_pairs;
+				trail.save_sibling_pair(sibling_pairs_copy, F1_a->get_label());
+				trail.save_sibling_pair(sibling_pairs_copy, F1_c->get_label());
 				sibling_pairs_copy.insert(make_pair(F1_a->get_label(), F1_c->get_label()));
 				sibling_pairs_copy.insert(make_pair(F1_c->get_label(), F1_a->get_label()));
-				list<int> singletons_copy = list<int>(singletons);
+				list<int> &singletons_copy = copy.singletons;
 	
 				debug(cout << F2_copy << endl);
 				int first_label = e_b.first;
 				int second_label = e_b.second;
+				trail.save_edge(F2_copy, first_label, second_label);
 				pair<int,int> components = F2_copy.cut_edge(first_label, second_label);
-				update_nodemapping(twins_copy, F2_copy, first_label, components.first, false);
-				update_nodemapping(twins_copy, F2_copy, second_label, components.second, false);
+				update_nodemapping(twins_copy, F2_copy, first_label, components.first, false, &trail);
+				update_nodemapping(twins_copy, F2_copy, second_label, components.second, false, &trail);
 				debug(cout << F2_copy << endl);
 				if (F2_copy.get_node(components.first)->is_singleton()) {
+					trail.save_singletons_push(singletons_copy);
 					singletons_copy.push_back(components.first);
 				}
 				if (F2_copy.get_node(components.second)->is_singleton()) {
+					trail.save_singletons_push(singletons_copy);
 					singletons_copy.push_back(components.second);
 				}
-				int branch_b = tbr_distance_hlpr(F1_copy, F2_copy, k-1, twins_copy, sibling_pairs_copy, singletons_copy, t, func_pointer, &MAF1_copy, &MAF2_copy);
+				int branch_b = tbr_distance_hlpr(F1_copy, F2_copy, k-1, twins_copy, sibling_pairs_copy, singletons_copy, trail, t, func_pointer, &MAF1_copy, &MAF2_copy);
+				trail.undo(copy.mark);
 	
 				bool delete_copy = true;
 				if (branch_b > result) {
@@ -1036,32 +1472,39 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 	
 				debug(cout  << "cut e_d" << endl);
 	
-				// copy the trees
-				uforest F1_copy = uforest(F1);
-				uforest F2_copy = uforest(F2);
+				// copy the trees, or change them in place and undo it after
+				tbr_branch copy = TBR_ARENA.branch(level, F1, F2, twins, sibling_pairs, singletons, trail);
+				uforest &F1_copy = copy.F1;
+				uforest &F2_copy = copy.F2;
 				uforest *MAF1_copy = NULL;
 				uforest *MAF2_copy = NULL;
-				nodemapping twins_copy = nodemapping(twins);
-				map<int, int> sibling_pairs_copy = map<int, int>(sibling_pairs);
+				nodemapping &twins_copy = copy.twins;
+				map<int, int> &sibling_pairs_copy = copy.sibling_pairs;
+				trail.save_sibling_pair(sibling_pairs_copy, F1_a->get_label());
+				trail.save_sibling_pair(sibling_pairs_copy, F1_c->get_label());
 				sibling_pairs_copy.insert(make_pair(F1_a->get_label(), F1_c->get_label()));
 				sibling_pairs_copy.insert(make_pair(F1_c->get_label(), F1_a->get_label()));
-				list<int> singletons_copy = list<int>(singletons);
+				list<int> &singletons_copy = copy.singletons;
 	
 				debug(cout << F2_copy << endl);
 				int first_label = e_d.first;
 				int second_label = e_d.second;
+				trail.save_edge(F2_copy, first_label, second_label);
 				pair<int,int> components = F2_copy.cut_edge(first_label, second_label);
-				update_nodemapping(twins_copy, F2_copy, first_label, components.first, false);
-				update_nodemapping(twins_copy, F2_copy, second_label, components.second, false);
+				update_nodemapping(twins_copy, F2_copy, first_label, components.first, false, &trail);
+				update_nodemapping(twins_copy, F2_copy, second_label, components.second, false, &trail);
 
 				debug(cout << F2_copy << endl);
 				if (F2_copy.get_node(components.first)->is_singleton()) {
+					trail.save_singletons_push(singletons_copy);
 					singletons_copy.push_back(components.first);
 				}
 				if (F2_copy.get_node(components.second)->is_singleton()) {
+					trail.save_singletons_push(singletons_copy);
 					singletons_copy.push_back(components.second);
 				}
-				int branch_d = tbr_distance_hlpr(F1_copy, F2_copy, k-1, twins_copy, sibling_pairs_copy, singletons_copy, t, func_pointer, &MAF1_copy, &MAF2_copy);
+				int branch_d = tbr_distance_hlpr(F1_copy, F2_copy, k-1, twins_copy, sibling_pairs_copy, singletons_copy, trail, t, func_pointer, &MAF1_copy, &MAF2_copy);
+				trail.undo(copy.mark);
 	
 				bool delete_copy = true;
 				if (branch_d > result) {
@@ -1087,6 +1530,7 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 					}
 				}
 			}
+			TBR_ARENA.leave();
 			return result;
 		}
 	}
@@ -1121,6 +1565,14 @@ int tbr_distance_hlpr(uforest &F1, uforest &F2, int k, nodemapping &twins, map<i
 		cout << "\t" << F1.str() << endl;
 		cout << "\t" << F2.str() << endl;
 	)
+	// the trail still has to undo the changes to this state, so finish a copy
+	if (trail.is_recording()) {
+		uforest F1_copy = uforest(F1);
+		uforest F2_copy = uforest(F2);
+		nodemapping twins_copy = nodemapping(twins);
+		tbr_trail no_trail = tbr_trail(false);
+		return tbr_distance_hlpr(F1_copy, F2_copy, k, twins_copy, sibling_pairs, singletons, no_trail, t, func_pointer, MAF1, MAF2);
+	}
 	int ret_k = k;
 	// cleanup the forests
 	F1.uncontract();
@@ -2722,7 +3174,7 @@ void find_dead_components_hlpr(unode *n, unode *prev, int component, uforest &T,
 	}
 }
 
-void update_nodemapping(nodemapping &twins, uforest &F, int original_label, int new_label, bool forward) {
+void update_nodemapping(nodemapping &twins, uforest &F, int original_label, int new_label, bool forward, tbr_trail *trail /* = NULL */) {
 	// odd bug
 	if (new_label == -1) {
 		return;
@@ -2744,9 +3196,15 @@ void update_nodemapping(nodemapping &twins, uforest &F, int original_label, int
 				parent_label = F.get_node(new_label)->get_parent()->get_label();
 			}
 			if (forward) {
+				if (trail != NULL) {
+					trail->save_twins(twins, parent_label, twin);
+				}
 				twins.add(parent_label, twin);
 			}
 			else {
+				if (trail != NULL) {
+					trail->save_twins(twins, twin, parent_label);
+				}
 				twins.add(twin, parent_label);
 			}
 		}
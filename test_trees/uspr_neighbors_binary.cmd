@@ -0,0 +1,13 @@
+# decoding a binary neighbor file gives the newick output
+while read T; do
+	echo "$T"
+	for moves in "" "--nni" "--radius 2"; do
+		text=`echo "$T" | ./uspr_neighbors $moves`
+		binary=`echo "$T" | ./uspr_neighbors $moves --binary | ./uspr_neighbors --read_binary`
+		if [ "$text" = "$binary" ]; then
+			echo "${moves:-spr}: `echo "$binary" | wc -l` trees match"
+		else
+			echo "${moves:-spr}: decoded trees differ"
+		fi
+	done
+done
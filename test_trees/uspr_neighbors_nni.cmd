@@ -0,0 +1,9 @@
+# a binary tree with n leaves has n-3 internal edges and two NNIs per
+# edge, so its NNI neighborhood has 2(n-3) trees
+while read T; do
+	n=$((`echo "$T" | tr -c -d ',' | wc -c` + 1))
+	echo "$T"
+	echo "2(n-3) = $((2 * (n - 3)))"
+	echo "$T" | ./uspr_neighbors --nni --size_only
+	echo "`echo "$T" | ./uspr_neighbors --nni --ignore_original | sort -u | wc -l` distinct neighbors"
+done
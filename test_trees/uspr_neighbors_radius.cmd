@@ -0,0 +1,5 @@
+# --radius only supports SPR moves
+./uspr_neighbors --radius 2 --nni </dev/null
+./uspr_neighbors --radius 2 --tbr </dev/null
+# every tree within two SPR moves and its SPR distance
+./uspr_neighbors --radius 2
@@ -0,0 +1,14 @@
+# every SPR neighbor of a tree is also a TBR neighbor
+while read T; do
+	echo "$T"
+	{
+		echo "$T" | ./uspr_neighbors --tbr --ignore_original | sed 's/^/TBR /'
+		echo "$T" | ./uspr_neighbors --ignore_original | sed 's/^/SPR /'
+	} | awk '
+		$1 == "TBR" { tbr[$2] = 1; num_tbr++ }
+		$1 == "SPR" { num_spr++; if (!($2 in tbr)) missing++ }
+		END {
+			print num_spr " SPR neighbors, " num_tbr " TBR neighbors"
+			print missing + 0 " SPR neighbors are not TBR neighbors"
+		}'
+done
@@ -0,0 +1,9 @@
+# seeded walks are reproducible and each pair is at most --moves SPR
+# moves apart
+read T
+walk() {
+	echo "$T" | ./uspr_walk --seed 7 --moves 3 --pairs 3
+	./uspr_walk --seed 7 --random 12 --moves 2 --pairs 2
+}
+walk
+walk | ./uspr --uspr | grep "^d_USPR"
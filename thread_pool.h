@@ -0,0 +1,134 @@
+/*******************************************************************************
+thread_pool.h
+
+A fixed set of threads that run parallel loops
+
+Copyright 2018 Chris Whidden
+cwhidden@fredhutch.org
+https://github.com/cwhidden/uspr
+May 1, 2018
+Version 1.0.1
+
+This file is part of uspr.
+
+uspr is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+uspr is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with uspr.  If not, see <http://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+#ifndef INCLUDE_THREAD_POOL
+#define INCLUDE_THREAD_POOL
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+// fixed set of threads that run parallel loops
+// the calling thread takes part in every loop as thread 0
+class thread_pool {
+	private:
+	vector<thread> threads;
+	mutex lock;
+	condition_variable start_work;
+	condition_variable work_done;
+	// task(item, thread)
+	function<void(int, int)> task;
+	int num_items;
+	atomic<int> next_item;
+	int running;
+	long generation;
+	bool stopping;
+
+	void work(int id) {
+		int i;
+		while ((i = next_item++) < num_items) {
+			task(i, id);
+		}
+	}
+
+	void run(int id) {
+		long seen = 0;
+		while (true) {
+			{
+				unique_lock<mutex> guard(lock);
+				while (!stopping && generation == seen) {
+					start_work.wait(guard);
+				}
+				if (stopping) {
+					return;
+				}
+				seen = generation;
+			}
+			work(id);
+			{
+				lock_guard<mutex> guard(lock);
+				running--;
+				if (running == 0) {
+					work_done.notify_one();
+				}
+			}
+		}
+	}
+
+	public:
+	thread_pool(int size) {
+		num_items = 0;
+		next_item = 0;
+		running = 0;
+		generation = 0;
+		stopping = false;
+		threads = vector<thread>();
+		for (int i = 1; i < size; i++) {
+			threads.push_back(thread(&thread_pool::run, this, i));
+		}
+	}
+
+	~thread_pool() {
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		start_work.notify_all();
+		for (thread &t : threads) {
+			t.join();
+		}
+	}
+
+	// call f(item, thread) for each item in [0, n) and wait for all calls
+	void parallel_for(int n, function<void(int, int)> f) {
+		{
+			lock_guard<mutex> guard(lock);
+			task = f;
+			num_items = n;
+			next_item = 0;
+			running = threads.size();
+			generation++;
+		}
+		start_work.notify_all();
+		work(0);
+		unique_lock<mutex> guard(lock);
+		while (running > 0) {
+			work_done.wait(guard);
+		}
+	}
+
+	int size() const {
+		return threads.size() + 1;
+	}
+};
+
+#endif
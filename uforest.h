@@ -51,19 +51,25 @@ class uforest: public utree {
 				leaves[smallest_leaf]->set_component(0);
 			}
 		}
-		uforest(const uforest &F) : utree(F) {
-			// copy vector of pointers
-			int components_size = F.components.size();
-			components = vector<unode *>(components_size);
-			// update with the new nodes
-			for(int i = 0; i < components_size; i++) {
-//				cout << "components[" << i << "]" << endl;
-				components[i] = get_node(F.components[i]->get_label());
-//				cout << "\t" << F.components[i] << ", " << components[i] << endl;
+		uforest(const int *encoding, int size) : utree(encoding, size) {
+			components = vector<unode *>();
+			if (leaves.size() > 0) {
+				components.push_back(leaves[smallest_leaf]);
+				leaves[smallest_leaf]->set_component(0);
 			}
 		}
-		uforest& operator=(uforest F) {
-			swap(*this, F);
+		uforest(const uforest &F) : utree(F) {
+			// forests are cut apart rather than changed by uspr
+			untrack_fingerprint();
+			copy_components(F);
+		}
+		// reuses this forest's memory, unlike copy construction
+		uforest& operator=(const uforest &F) {
+			if (this != &F) {
+				utree::operator=(F);
+				untrack_fingerprint();
+				copy_components(F);
+			}
 			return *this;
 		}
 		friend void swap(uforest &first, uforest &second) {
@@ -180,6 +186,15 @@ class uforest: public utree {
 			return components.size();
 		}
 
+		unode *get_component(int c) {
+			return components[c];
+		}
+
+		// drop the components after the first n, to undo cuts
+		void remove_components_after(int n) {
+			components.resize(n);
+		}
+
 		void uncontract() {
 			for (unode *c : components) {
 				unode *root = c;
@@ -221,6 +236,16 @@ class uforest: public utree {
 			c->normalize_order();
 		}
 	}
+
+	private:
+	// point the components at the copies of F's components
+	void copy_components(const uforest &F) {
+		int components_size = F.components.size();
+		components.resize(components_size);
+		for(int i = 0; i < components_size; i++) {
+			components[i] = get_node(F.components[i]->get_label());
+		}
+	}
 };
 
 ostream& operator<<(ostream &os, const uforest& f) {
@@ -38,58 +38,225 @@ along with uspr.  If not, see <http://www.gnu.org/licenses/>.
 #include <list>
 #include <sstream>
 #include <cstdio>
+#include <cstring>
+#include <iterator>
 #include <climits>
+#include "fingerprint.h"
 
 using namespace std;
 
 class unode;
 
+// the neighbors of a node, in order
+// a node of a binary tree has at most three neighbors, so they are kept
+// inline and only move to the heap when contraction gives a node more.
+// Unlike std::list, iterators are invalidated by changes to the list
+class neighbor_list {
+	public:
+	typedef unode **iterator;
+	typedef unode * const *const_iterator;
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+	private:
+	static const int INLINE_SIZE = 3;
+	union {
+		unode *inline_nodes[INLINE_SIZE];
+		unode **heap_nodes;
+	};
+	int count;
+	int capacity;
+
+	public:
+	neighbor_list() {
+		count = 0;
+		capacity = INLINE_SIZE;
+	}
+	neighbor_list(const neighbor_list &l) {
+		count = 0;
+		capacity = INLINE_SIZE;
+		reserve(l.count);
+		memcpy(begin(), l.begin(), l.count * sizeof(unode *));
+		count = l.count;
+	}
+	~neighbor_list() {
+		if (capacity > INLINE_SIZE) {
+			delete[] heap_nodes;
+		}
+	}
+	neighbor_list& operator=(const neighbor_list &l) {
+		if (this != &l) {
+			reserve(l.count);
+			memcpy(begin(), l.begin(), l.count * sizeof(unode *));
+			count = l.count;
+		}
+		return *this;
+	}
+	friend void swap(neighbor_list &first, neighbor_list &second) {
+		// inline_nodes covers heap_nodes
+		unode *temp[INLINE_SIZE];
+		memcpy(temp, first.inline_nodes, sizeof(temp));
+		memcpy(first.inline_nodes, second.inline_nodes, sizeof(temp));
+		memcpy(second.inline_nodes, temp, sizeof(temp));
+		std::swap(first.count, second.count);
+		std::swap(first.capacity, second.capacity);
+	}
+
+	iterator begin() {
+		return capacity > INLINE_SIZE ? heap_nodes : inline_nodes;
+	}
+	iterator end() {
+		return begin() + count;
+	}
+	const_iterator begin() const {
+		return capacity > INLINE_SIZE ? heap_nodes : inline_nodes;
+	}
+	const_iterator end() const {
+		return begin() + count;
+	}
+	reverse_iterator rbegin() {
+		return reverse_iterator(end());
+	}
+	reverse_iterator rend() {
+		return reverse_iterator(begin());
+	}
+	const_reverse_iterator rbegin() const {
+		return const_reverse_iterator(end());
+	}
+	const_reverse_iterator rend() const {
+		return const_reverse_iterator(begin());
+	}
+
+	unode *front() const {
+		return *begin();
+	}
+	unode *back() const {
+		return begin()[count - 1];
+	}
+	size_t size() const {
+		return count;
+	}
+	bool empty() const {
+		return count == 0;
+	}
+
+	void push_back(unode *n) {
+		reserve(count + 1);
+		begin()[count++] = n;
+	}
+	void push_front(unode *n) {
+		reserve(count + 1);
+		unode **nodes = begin();
+		memmove(nodes + 1, nodes, count * sizeof(unode *));
+		nodes[0] = n;
+		count++;
+	}
+	void pop_front() {
+		unode **nodes = begin();
+		memmove(nodes, nodes + 1, (count - 1) * sizeof(unode *));
+		count--;
+	}
+
+	// remove each occurrence of n, returns false if there are none
+	bool remove(unode *n) {
+		unode **nodes = begin();
+		int j = 0;
+		for (int i = 0; i < count; i++) {
+			if (nodes[i] != n) {
+				nodes[j++] = nodes[i];
+			}
+		}
+		bool removed = (j < count);
+		count = j;
+		return removed;
+	}
+	void clear() {
+		count = 0;
+	}
+
+	// stable insertion sort, the lists are short
+	template <typename C>
+	void sort(C compare) {
+		unode **nodes = begin();
+		for (int i = 1; i < count; i++) {
+			unode *n = nodes[i];
+			int j = i;
+			for (; j > 0 && compare(n, nodes[j-1]); j--) {
+				nodes[j] = nodes[j-1];
+			}
+			nodes[j] = n;
+		}
+	}
+
+	private:
+	void reserve(int n) {
+		if (n <= capacity) {
+			return;
+		}
+		int new_capacity = 2 * capacity;
+		if (new_capacity < n) {
+			new_capacity = n;
+		}
+		unode **nodes = new unode *[new_capacity];
+		memcpy(nodes, begin(), count * sizeof(unode *));
+		if (capacity > INLINE_SIZE) {
+			delete[] heap_nodes;
+		}
+		heap_nodes = nodes;
+		capacity = new_capacity;
+	}
+};
+
 class unode {
 	private:
 	int label;
-	list<unode *> neighbors;
-	list<unode *> contracted_neighbors;
+	neighbor_list neighbors;
+	neighbor_list contracted_neighbors;
 	int num_neighbors;
 	int component;
 	bool terminal;
 	int distance;
 	bool b_protected;
 	bool phi;
+	tree_fingerprint clade;
+	int min_descendant;
 
 	public:
 	unode() {
 		label = -1;
-		neighbors = list<unode *>();
-		contracted_neighbors = list<unode *>();
+		neighbors = neighbor_list();
+		contracted_neighbors = neighbor_list();
 		num_neighbors = 0;
 		component = -1;
 		terminal = false;
 		distance = -1;
 		b_protected = false;
 		phi = false;
+		min_descendant = -1;
 	}
 	unode(int l) {
 		label = l;
-		neighbors = list<unode *>();
-		contracted_neighbors = list<unode *>();
+		neighbors = neighbor_list();
+		contracted_neighbors = neighbor_list();
 		num_neighbors = 0;
 		component = -1;
 		terminal = false;
 		distance = -1;
 		b_protected = false;
 		phi = false;
+		min_descendant = -1;
 	}
 	unode(const unode &n, bool include_neighbors = true) {
 		label = n.label;
 		// don't include neighbors when copying as they will be updated later
 		if (include_neighbors) {
-			neighbors = list<unode *>(n.neighbors);
-			contracted_neighbors = list<unode *>(n.contracted_neighbors);
+			neighbors = n.neighbors;
+			contracted_neighbors = n.contracted_neighbors;
 			num_neighbors = n.num_neighbors;
 		}
 		else {
-			neighbors = list<unode *>();
-			contracted_neighbors = list<unode *>();
+			neighbors = neighbor_list();
+			contracted_neighbors = neighbor_list();
 			num_neighbors = 0;
 		}
 		component = n.component;
@@ -97,6 +264,8 @@ class unode {
 		distance = n.distance;
 		b_protected = n.b_protected;
 		phi = n.phi;
+		clade = n.clade;
+		min_descendant = n.min_descendant;
 	}
 	~unode() {
 		neighbors.clear();
@@ -123,34 +292,15 @@ class unode {
 	}
 
 	bool remove_neighbor(unode *n) {
-		list<unode *>::iterator i;
-		bool result = false;
-		for(i = neighbors.begin(); i != neighbors.end(); i++) {
-			if ((*i) == n) {
-				result = true;
-				break;
-			}
-		}
+		bool result = neighbors.remove(n);
 		if (result) {
-			neighbors.remove(*i);
 			num_neighbors--;
 		}
 		return result;
 	}
 
 	bool remove_contracted_neighbor(unode *n) {
-		list<unode *>::iterator i;
-		bool result = false;
-		for(i = contracted_neighbors.begin(); i != contracted_neighbors.end(); i++) {
-			if ((*i) == n) {
-				result = true;
-				break;
-			}
-		}
-		if (result) {
-			contracted_neighbors.remove(*i);
-		}
-		return result;
+		return contracted_neighbors.remove(n);
 	}
 
 	bool contract_neighbor(unode *n) {
@@ -167,9 +317,11 @@ class unode {
 			ss << "*";
 		}
 		else {
+			map<int, string>::const_iterator l;
 			if (reverse_label_map != NULL &&
-					reverse_label_map->find(label) != reverse_label_map->end()) {
-				ss << (*reverse_label_map)[label];
+					(l = reverse_label_map->find(label)) != reverse_label_map->end()) {
+				// find rather than [] so threads can share the map
+				ss << l->second;
 			}
 			else {
 				ss << label;
@@ -190,19 +342,19 @@ class unode {
 		return label;
 	}
 
-	const list<unode *> &const_neighbors() const {
+	const neighbor_list &const_neighbors() const {
 		return neighbors;
 	}
 
-	const list<unode *> &const_contracted_neighbors() const {
+	const neighbor_list &const_contracted_neighbors() const {
 		return contracted_neighbors;
 	}
 
-	list<unode *> &get_neighbors() {
+	neighbor_list &get_neighbors() {
 		return neighbors;
 	}
 
-	list<unode *> &get_contracted_neighbors() {
+	neighbor_list &get_contracted_neighbors() {
 		return contracted_neighbors;
 	}
 
@@ -293,7 +445,7 @@ class unode {
 	}
 
 	unode *get_neighbor_not(unode *a, unode *b) {
-		list<unode *>::reverse_iterator x;
+		neighbor_list::reverse_iterator x;
 		for (x = neighbors.rbegin(); x != neighbors.rend(); x++) {
 			if (*x != a && *x != b) {
 				return *x;
@@ -331,6 +483,13 @@ class unode {
 		contracted_neighbors.clear();
 	}
 
+	// replace both neighbor lists, as when restoring a saved node
+	void set_neighbors(const neighbor_list &n, const neighbor_list &c) {
+		neighbors = n;
+		contracted_neighbors = c;
+		num_neighbors = n.size();
+	}
+
 	void uncontract_neighbors() {
 		for (unode *x: contracted_neighbors) {
 			add_neighbor(x);
@@ -356,7 +515,7 @@ class unode {
 		debug(
 			cout << label << ".contract_degree_two_subtree()" << endl;
 		)
-		list<unode *> neighbor_copy = list<unode *>(get_neighbors());
+		neighbor_list neighbor_copy = neighbor_list(get_neighbors());
 		for (unode *n : neighbor_copy) {
 			if (last == NULL || n != last) {
 				n->contract_degree_two_subtree(this);
@@ -477,6 +636,41 @@ class unode {
 	int get_distance() {
 		return distance;
 	}
+
+	// sum of the leaf keys below this node, kept by utree::track_fingerprint
+	void set_clade(const tree_fingerprint &f) {
+		clade = f;
+	}
+
+	const tree_fingerprint &get_clade() const {
+		return clade;
+	}
+
+	void set_min_descendant(int l) {
+		min_descendant = l;
+	}
+
+	int get_min_descendant() const {
+		return min_descendant;
+	}
+
+	// order the children by their smallest descendant leaf, as
+	// normalize_order does, and update this node's smallest descendant
+	// requires the parent to be the first neighbor and the children's
+	// smallest descendants to be current
+	void normalize_children() {
+		if (label >= 0) {
+			min_descendant = label;
+			return;
+		}
+		unode *parent = neighbors.front();
+		neighbors.pop_front();
+		neighbors.sort([](const unode *a, const unode *b) {
+			return a->min_descendant < b->min_descendant;
+		});
+		min_descendant = neighbors.front()->min_descendant;
+		neighbors.push_front(parent);
+	}
 	bool is_singleton() {
 		if (num_neighbors == 0) {
 			return true;
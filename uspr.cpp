@@ -111,10 +111,49 @@ string USAGE =
 "                       optimization for enumerating agreement forests. In most\n"
 "                       cases these options will greatly increase the time required\n"
 "                       by uspr.\n"
+"\n"
+"--undo-trail           Search for agreement forests by changing the forests in\n"
+"                       place and undoing the changes when backtracking, rather\n"
+"                       than copying them for each branch of the search.\n"
+"\n"
+"--threads N            Compute the uSPR distance with a parallel A* search using N\n"
+"                       threads. Trees are distributed between threads by hash.\n"
+"\n"
+"--bidirectional        Compute the uSPR distance with a bidirectional A* search\n"
+"                       from both trees. Runs on a single thread.\n"
+"\n"
+"--time-limit S\n"
+"--node-limit N         Stop the uSPR search after S seconds or after examining N\n"
+"                       trees and print the best lower and upper bounds found.\n"
+"                       Bounds are printed as they improve. Applies to the\n"
+"                       default search.\n"
+"\n"
+"--ida                  Compute the uSPR distance with an iterative deepening A*\n"
+"                       search. Uses far less memory than the default search but\n"
+"                       may examine trees many times.\n"
+"\n"
+"--guided-moves         Expand each tree in two stages in the default search.\n"
+"                       First queue the SPRs that prune an edge cut by a\n"
+"                       maximum agreement forest with the target and regraft it\n"
+"                       to form a split of the target, then the rest of the\n"
+"                       neighborhood only if no better tree is found first.\n"
+"                       Requires the TBR estimate and replaces the parallel search.\n"
+"\n"
+"--score-neighbors      Estimate the distance of each new tree as soon as it is\n"
+"                       generated rather than when it is first removed from the\n"
+"                       queue. With --threads N the estimates are computed by N\n"
+"                       threads in the usual A* search instead of the parallel\n"
+"                       A* search.\n"
+"\n"
+"--estimate-cache MB    Cache up to MB megabytes of uSPR distance estimates and\n"
+"                       reuse them in later searches. Cache statistics are\n"
+"                       printed at exit.\n"
 "\n";
 
 
 // function prototypes
+void compare_trees(string &T1_line, string &T2_line, map<string, int> &label_map, map<int, string> &reverse_label_map);
+
 int main(int argc, char *argv[])
 {
 	int max_args = argc-1;
@@ -136,6 +175,9 @@ int main(int argc, char *argv[])
 		else if (strcmp(arg, "--no-protect-b") == 0) {
 			OPTIMIZE_PROTECT_B = false;
 		}
+		else if (strcmp(arg, "--undo-trail") == 0) {
+			TBR_UNDO_TRAIL = true;
+		}
 		else if (strcmp(arg, "--tbr-approx") == 0) {
 			COMPUTE_TBR_APPROX = true;
 			ALL_DISTANCES = false;
@@ -161,6 +203,50 @@ int main(int argc, char *argv[])
 		else if (strcmp(arg, "--no-replug-estimate") == 0) {
 			USE_REPLUG_ESTIMATE = false;
 		}
+		else if (strcmp(arg, "--estimate-cache") == 0) {
+			if (max_args > argc) {
+				char *arg2 = argv[argc+1];
+				if (arg2[0] != '-') {
+					ESTIMATE_CACHE.set_size(atoi(arg2));
+				}
+			}
+		}
+		else if (strcmp(arg, "--guided-moves") == 0) {
+			GUIDED_MOVES = true;
+		}
+		else if (strcmp(arg, "--score-neighbors") == 0) {
+			SCORE_NEIGHBORS = true;
+		}
+		else if (strcmp(arg, "--time-limit") == 0) {
+			if (max_args > argc) {
+				char *arg2 = argv[argc+1];
+				if (arg2[0] != '-') {
+					TIME_LIMIT = atof(arg2);
+				}
+			}
+		}
+		else if (strcmp(arg, "--node-limit") == 0) {
+			if (max_args > argc) {
+				char *arg2 = argv[argc+1];
+				if (arg2[0] != '-') {
+					NODE_LIMIT = atol(arg2);
+				}
+			}
+		}
+		else if (strcmp(arg, "--ida") == 0) {
+			IDA_SEARCH = true;
+		}
+		else if (strcmp(arg, "--bidirectional") == 0) {
+			BIDIRECTIONAL_SEARCH = true;
+		}
+		else if (strcmp(arg, "--threads") == 0) {
+			if (max_args > argc) {
+				char *arg2 = argv[argc+1];
+				if (arg2[0] != '-') {
+					NUM_THREADS = atoi(arg2);
+				}
+			}
+		}
 		else if (strcmp(arg, "--help") == 0 ||
 				strcmp(arg, "-h") == 0 ||
 				strcmp(arg, "-help") == 0) {
@@ -195,6 +281,17 @@ int main(int argc, char *argv[])
 	string T1_line = "";
 	string T2_line = "";
 
+	// without simulation runs, compare pairs of trees from STDIN
+	if (!ifstream("0_sim").is_open()) {
+		while (getline(cin, T1_line) && getline(cin, T2_line)) {
+			compare_trees(T1_line, T2_line, label_map, reverse_label_map);
+		}
+		if (ESTIMATE_CACHE.enabled()) {
+			cout << ESTIMATE_CACHE.str() << endl;
+		}
+		return 0;
+	}
+
   //RJG - output file
   ofstream TBR_out("TBR_out.txt", ios::out | ios::app);
 
@@ -297,7 +394,9 @@ int main(int argc, char *argv[])
 
 							if (COMPUTE_USPR) {
 								int d_uspr = uspr_distance(F1, F2);
-								cout << "d_USPR = " << d_uspr << endl;
+								if (d_uspr >= 0) {
+									cout << "d_USPR = " << d_uspr << endl;
+								}
 							}
 
 						}
@@ -380,7 +479,9 @@ int main(int argc, char *argv[])
 
 							if (COMPUTE_USPR) {
 								int d_uspr = uspr_distance(F1, F2);
-								cout << "d_USPR = " << d_uspr << endl;
+								if (d_uspr >= 0) {
+									cout << "d_USPR = " << d_uspr << endl;
+								}
 							}
 
 						}
@@ -463,7 +564,9 @@ int main(int argc, char *argv[])
 
 							if (COMPUTE_USPR) {
 								int d_uspr = uspr_distance(F1, F2);
-								cout << "d_USPR = " << d_uspr << endl;
+								if (d_uspr >= 0) {
+									cout << "d_USPR = " << d_uspr << endl;
+								}
 							}
 
 						}
@@ -477,5 +580,72 @@ int main(int argc, char *argv[])
 			}
 	}
 
+	if (ESTIMATE_CACHE.enabled()) {
+		cout << ESTIMATE_CACHE.str() << endl;
+	}
+
+
+}
+
+// print the distances requested by the options between two trees
+void compare_trees(string &T1_line, string &T2_line, map<string, int> &label_map, map<int, string> &reverse_label_map) {
+	// load into data structures
+	uforest F1 = uforest(T1_line, &label_map, &reverse_label_map);
+	F1.normalize_order();
+	uforest F2 = uforest(T2_line, &label_map, &reverse_label_map);
+	F2.normalize_order();
+	cout << "T1: " << F1.str(false, &reverse_label_map) << endl;
+	cout << "T2: " << F2.str(false, &reverse_label_map) << endl;
+
+	// compute TBR distance
+	if (COMPUTE_TBR_APPROX) {
+		cout << "a_TBR: " << tbr_high_lower_bound(F1, F2) << " <= d_TBR <= " << tbr_low_upper_bound(F1, F2) << endl;
+	}
+
+	if (COMPUTE_TBR) {
+		uforest *MAF1 = NULL;
+		uforest *MAF2 = NULL;
+		int distance = tbr_distance(F1, F2, false, &MAF1, &MAF2);
+		cout << "d_TBR = " << distance << endl;
+		if (MAF1 != NULL) {
+			cout << "F1: " << MAF1->str(false, &reverse_label_map) << endl;
+			delete MAF1;
+		}
+		if (MAF2 != NULL) {
+			cout << "F2: " << MAF2->str(false, &reverse_label_map) << endl;
+			delete MAF2;
+		}
+	}
+
+	int count;
+	if (PRINT_mAFS) {
+		count = tbr_print_mAFs(F1, F2);
+		cout << count << " mAFs" << endl;
+	}
+	else if (COUNT_mAFS) {
+		count = tbr_count_mAFs(F1, F2);
+		cout << count << " mAFs" << endl;
+	}
 
+	if (COMPUTE_REPLUG) {
+		uforest *MAF1 = NULL;
+		uforest *MAF2 = NULL;
+		int d_replug = replug_distance(F1, F2, false, &MAF1, &MAF2);
+		cout << "d_R = " << d_replug << endl;
+		if (MAF1 != NULL) {
+			cout << "F1: " << MAF1->str(false, &reverse_label_map) << endl;
+			delete MAF1;
+		}
+		if (MAF2 != NULL) {
+			cout << "F2: " << MAF2->str(false, &reverse_label_map) << endl;
+			delete MAF2;
+		}
+	}
+
+	if (COMPUTE_USPR) {
+		int d_uspr = uspr_distance(F1, F2);
+		if (d_uspr >= 0) {
+			cout << "d_USPR = " << d_uspr << endl;
+		}
+	}
 }
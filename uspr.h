@@ -36,6 +36,13 @@ along with uspr.  If not, see <http://www.gnu.org/licenses/>.
 #include <vector>
 #include <map>
 #include <set>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
 #include <list>
 #include <memory>
 #include <ctime>
@@ -45,6 +52,7 @@ along with uspr.  If not, see <http://www.gnu.org/licenses/>.
 #include "uforest.h"
 #include "tbr.h"
 #include "uspr_neighbors.h"
+#include "thread_pool.h"
 
 //#define DEBUG_USPR 1
 #ifdef DEBUG_USPR
@@ -57,6 +65,15 @@ along with uspr.  If not, see <http://www.gnu.org/licenses/>.
 bool USE_TBR_APPROX_ESTIMATE = true;
 bool USE_TBR_ESTIMATE = true;
 bool USE_REPLUG_ESTIMATE = true;
+int NUM_THREADS = 1;
+bool BIDIRECTIONAL_SEARCH = false;
+bool SCORE_NEIGHBORS = false;
+bool IDA_SEARCH = false;
+bool GUIDED_MOVES = false;
+int IDA_TABLE_SIZE = 1 << 20;
+// anytime limits for the default search, 0 for no limit
+double TIME_LIMIT = 0;
+long NODE_LIMIT = 0;
 
 // classes
 
@@ -72,50 +89,446 @@ class tree_distance {
 	int estimate;
 	// cost + estimate
 	int distance;
-	// the tree
-	string tree;
+	// handle of the tree in the search's tree store
+	int tree;
 	// estimator used
 	estimator_t estimator;
+	// TBR and replug distances of this tree and of the tree it was
+	// reached from, -1 if unknown. One SPR changes either distance by at
+	// most one, so a parent's value bounds the search for the child's
+	int tbr;
+	int replug;
+	int parent_tbr;
+	int parent_replug;
+	// only the moves guided by an agreement forest have been generated
+	bool guided;
 
-	tree_distance(int c, int d, string t, estimator_t e) {
+	tree_distance(int c, int d, int t, estimator_t e) {
 		cost = c;
 		estimate = d;
 		distance = c + d;
 		tree = t;
 		estimator = e;
+		tbr = -1;
+		replug = -1;
+		parent_tbr = -1;
+		parent_replug = -1;
+		guided = false;
 	}
 
-	friend bool operator < (tree_distance a, tree_distance b);
-	friend bool operator <= (tree_distance a, tree_distance b);
+	// a new estimate for the same tree, keeping the known distances
+	tree_distance(const tree_distance &prev, int d, estimator_t e) {
+		*this = prev;
+		estimate = d;
+		distance = cost + d;
+		estimator = e;
+		if (e == TBR) {
+			tbr = d;
+		}
+		else if (e == REPLUG) {
+			replug = d;
+		}
+	}
 
+	// a neighbor of the tree reached by one SPR
+	tree_distance child(int t) const {
+		tree_distance c = tree_distance(cost + 1, 1, t, BFS);
+		c.parent_tbr = tbr;
+		c.parent_replug = replug;
+		return c;
+	}
 };
 
-// prefer better estimates when equal
-bool operator < (tree_distance a, tree_distance b) {
-	if (a.distance == b.distance) {
-		if (a.estimate == b.estimate) {
-			return a.estimator < b.estimator;
+// bucket queue of tree distances
+// buckets are indexed by distance, then estimate, then estimator and each
+// bucket is FIFO, giving the same order as a multiset sorted by distance
+// that prefers better estimates when equal
+class distance_queue {
+	private:
+	// buckets[distance][estimate * NUM_ESTIMATORS + estimator]
+	vector<vector<deque<tree_distance> > > buckets;
+	int min_distance;
+	int num_entries;
+
+	public:
+	static const int NUM_ESTIMATORS = BFS + 1;
+
+	distance_queue() {
+		buckets = vector<vector<deque<tree_distance> > >();
+		min_distance = 0;
+		num_entries = 0;
+	}
+
+	void insert(const tree_distance &t) {
+		if ((size_t)t.distance >= buckets.size()) {
+			buckets.resize(t.distance + 1);
 		}
-		else {
-			return a.estimate < b.estimate;
+		vector<deque<tree_distance> > &b = buckets[t.distance];
+		size_t index = t.estimate * NUM_ESTIMATORS + t.estimator;
+		if (index >= b.size()) {
+			b.resize(index + 1);
+		}
+		b[index].push_back(t);
+		if (num_entries == 0 || t.distance < min_distance) {
+			min_distance = t.distance;
 		}
+		num_entries++;
 	}
-	return a.distance < b.distance; } 
-bool operator <= (tree_distance a, tree_distance b) {
-	if (a.distance == b.distance) {
-		if (a.estimate == b.estimate) {
-			return a.estimator <= b.estimator;
+
+	// remove and return the best entry, the queue must not be empty
+	tree_distance pop() {
+		while (true) {
+			for (deque<tree_distance> &bucket : buckets[min_distance]) {
+				if (!bucket.empty()) {
+					tree_distance t = bucket.front();
+					bucket.pop_front();
+					num_entries--;
+					return t;
+				}
+			}
+			min_distance++;
 		}
-		else {
-			return a.estimate <= b.estimate;
+	}
+
+	// distance of the best entry, the queue must not be empty
+	int top_distance() {
+		while (true) {
+			for (deque<tree_distance> &bucket : buckets[min_distance]) {
+				if (!bucket.empty()) {
+					return min_distance;
+				}
+			}
+			min_distance++;
 		}
 	}
-	return a.distance <= b.distance;
-}
 
+	bool empty() const {
+		return num_entries == 0;
+	}
+
+	int size() const {
+		return num_entries;
+	}
+};
+
+
+// compact encodings of the trees seen by a search
+// every tree in one search has the same number of nodes, so the encodings
+// are stored back to back in a single buffer and indexed by position
+class tree_store {
+	private:
+	vector<int> encodings;
+	int tree_size;
+	int num_trees;
+
+	public:
+	tree_store() {
+		encodings = vector<int>();
+		tree_size = 0;
+		num_trees = 0;
+	}
+
+	// add a normalized tree and return its handle
+	int add(const utree &T) {
+		int start = encodings.size();
+		T.encode(encodings);
+		if (tree_size == 0) {
+			tree_size = encodings.size() - start;
+		}
+		return num_trees++;
+	}
+
+	// add an encoding produced by utree::encode
+	int add(const vector<int> &encoding) {
+		encodings.insert(encodings.end(), encoding.begin(), encoding.end());
+		if (tree_size == 0) {
+			tree_size = encoding.size();
+		}
+		return num_trees++;
+	}
+
+	const int *get(int handle) const {
+		return &encodings[handle * tree_size];
+	}
+
+	int get_tree_size() const {
+		return tree_size;
+	}
+
+	bool equals(int handle, const vector<int> &encoding) const {
+		return encoding.size() == (size_t)tree_size &&
+				equal(encoding.begin(), encoding.end(), get(handle));
+	}
+
+	int size() const {
+		return num_trees;
+	}
+};
+
+// set of trees held in a tree_store
+// trees are found by fingerprint and then compared by encoding, so trees
+// whose fingerprints collide are still kept apart
+class tree_set {
+	private:
+	tree_store *trees;
+	vector<tree_fingerprint> fingerprints;
+	vector<int> handles;
+	size_t num_entries;
+	size_t mask;
+
+	void grow() {
+		vector<tree_fingerprint> old_fingerprints = vector<tree_fingerprint>();
+		vector<int> old_handles = vector<int>();
+		old_fingerprints.swap(fingerprints);
+		old_handles.swap(handles);
+		fingerprints = vector<tree_fingerprint>(old_handles.size() * 2);
+		handles = vector<int>(old_handles.size() * 2, -1);
+		mask = handles.size() - 1;
+		for (size_t i = 0; i < old_handles.size(); i++) {
+			if (old_handles[i] >= 0) {
+				size_t j = old_fingerprints[i].low & mask;
+				while (handles[j] >= 0) {
+					j = (j + 1) & mask;
+				}
+				fingerprints[j] = old_fingerprints[i];
+				handles[j] = old_handles[i];
+			}
+		}
+	}
+
+	public:
+	tree_set(tree_store *t, size_t initial_size = 1024) {
+		trees = t;
+		size_t size = 16;
+		while (size < initial_size) {
+			size *= 2;
+		}
+		fingerprints = vector<tree_fingerprint>(size);
+		handles = vector<int>(size, -1);
+		num_entries = 0;
+		mask = size - 1;
+	}
+
+	// add a tree with fingerprint f and the given encoding to the store
+	// and return its handle, or return -1 if it is already in the set
+	int insert(const tree_fingerprint &f, const vector<int> &encoding) {
+		size_t i = f.low & mask;
+		while (handles[i] >= 0) {
+			if (fingerprints[i] == f && trees->equals(handles[i], encoding)) {
+				return -1;
+			}
+			i = (i + 1) & mask;
+		}
+		int handle = trees->add(encoding);
+		fingerprints[i] = f;
+		handles[i] = handle;
+		num_entries++;
+		if (num_entries * 10 > handles.size() * 7) {
+			grow();
+		}
+		return handle;
+	}
+
+	size_t size() const {
+		return num_entries;
+	}
+};
+
+
+// fixed size cache of estimates shared by all searches
+// entries are keyed by the fingerprints of a tree and the target and keep
+// the best estimate computed for the pair. The cache is direct mapped, so
+// a new pair replaces whatever shared its slot; estimates are lower bounds
+// whether or not they are cached, so eviction never affects correctness
+class estimate_cache {
+	private:
+	class entry {
+		public:
+		tree_fingerprint key;
+		int estimate;
+		estimator_t estimator;
+	};
+	vector<entry> entries;
+	mutex lock;
+	long lookups;
+	long hits;
+	long stored;
+
+	public:
+	estimate_cache() {
+		entries = vector<entry>();
+		lookups = 0;
+		hits = 0;
+		stored = 0;
+	}
+
+	// use at most the given number of megabytes, 0 disables the cache
+	void set_size(size_t megabytes) {
+		lock_guard<mutex> guard(lock);
+		entries = vector<entry>((megabytes << 20) / sizeof(entry));
+		stored = 0;
+	}
+
+	bool enabled() const {
+		return !entries.empty();
+	}
+
+	static tree_fingerprint get_key(const tree_fingerprint &tree, const tree_fingerprint &target) {
+		return tree_fingerprint(fingerprint_mix(tree.high ^ fingerprint_mix(target.high)),
+				fingerprint_mix(tree.low ^ fingerprint_mix(target.low)));
+	}
+
+	bool lookup(const tree_fingerprint &key, int &estimate, estimator_t &estimator) {
+		lock_guard<mutex> guard(lock);
+		lookups++;
+		entry &e = entries[key.low % entries.size()];
+		if (e.key != key) {
+			return false;
+		}
+		hits++;
+		estimate = e.estimate;
+		estimator = e.estimator;
+		return true;
+	}
+
+	void insert(const tree_fingerprint &key, int estimate, estimator_t estimator) {
+		lock_guard<mutex> guard(lock);
+		entry &e = entries[key.low % entries.size()];
+		if (e.key == key) {
+			if (estimator > e.estimator) {
+				return;
+			}
+		}
+		else if (e.key.empty()) {
+			stored++;
+		}
+		e.key = key;
+		e.estimate = estimate;
+		e.estimator = estimator;
+	}
+
+	string str() {
+		lock_guard<mutex> guard(lock);
+		stringstream ss;
+		ss << "estimate cache: " << hits << " hits in " << lookups << " lookups";
+		if (lookups > 0) {
+			ss << " (" << (100.0 * hits / lookups) << "%)";
+		}
+		ss << ", " << stored << " of " << entries.size() << " entries used";
+		return ss.str();
+	}
+};
+
+estimate_cache ESTIMATE_CACHE;
+
+// message carrying a generated tree to the worker that owns it
+class tree_message {
+	public:
+	tree_fingerprint fingerprint;
+	int cost;
+	vector<int> encoding;
+	tree_message *next;
+};
+
+// lock-free stack of messages with many producers and one consumer
+class message_queue {
+	private:
+	atomic<tree_message *> head;
+
+	public:
+	message_queue() : head(NULL) {
+	}
+
+	void push(tree_message *m) {
+		m->next = head.load();
+		while (!head.compare_exchange_weak(m->next, m)) {
+		}
+	}
+
+	// remove all messages and return them in the order they were pushed
+	tree_message *take_all() {
+		tree_message *m = head.exchange(NULL);
+		tree_message *ordered = NULL;
+		while (m != NULL) {
+			tree_message *next = m->next;
+			m->next = ordered;
+			ordered = m;
+			m = next;
+		}
+		return ordered;
+	}
+};
+
+// open and closed lists of a search with reopening
+class search_frontier {
+	public:
+	distance_queue open;
+	// lowest cost found for each tree
+	fingerprint_map closed;
+	tree_store trees;
+	vector<tree_fingerprint> fingerprints;
+	// tree the estimates are computed against
+	// private copy as replug_distance modifies its arguments
+	uforest target;
+
+	search_frontier(uforest &t) : target(t) {
+		open = distance_queue();
+		closed = fingerprint_map();
+		trees = tree_store();
+		fingerprints = vector<tree_fingerprint>();
+	}
+
+	// record a tree reached with the given cost
+	// returns false if it was already reached at least as cheaply
+	bool add(const tree_fingerprint &f, int cost, const vector<int> &encoding) {
+		if (!closed.insert_min(f, cost)) {
+			return false;
+		}
+		int tree = trees.add(encoding);
+		fingerprints.push_back(f);
+		open.insert(tree_distance(cost, 1, tree, BFS));
+		return true;
+	}
+};
+
+// one thread of a parallel search and the trees it owns
+class uspr_worker : public search_frontier {
+	public:
+	message_queue inbox;
+
+	uspr_worker(uforest &target) : search_frontier(target) {
+	}
+};
+
+// state shared by the workers of a parallel search
+class uspr_parallel_search {
+	public:
+	vector<uspr_worker *> workers;
+	vector<int> target;
+	estimator_t final_estimator;
+	// cost of the best path to the target found so far
+	atomic<int> upper_bound;
+	// messages in flight plus workers that are not idle
+	atomic<long> outstanding;
+};
 
 // function prototypes
 int uspr_distance(uforest &T1, uforest &T2);
+int uspr_distance_parallel(uforest &T1, uforest &T2);
+int uspr_distance_bidirectional(uforest &T1, uforest &T2);
+int uspr_distance_ida(uforest &T1, uforest &T2);
+int uspr_ida_hlpr(uforest &T, uforest &T2, vector<int> &target, int cost, int threshold, int &next_threshold, estimator_t final_estimator, fingerprint_map &table, long &examined);
+estimator_t get_final_estimator();
+estimator_t next_estimate(uforest &T, uforest &T2, estimator_t prev_estimator, int &distance, int parent_tbr = -1, int parent_replug = -1);
+bool next_expansion(search_frontier &side, estimator_t final_estimator, tree_distance &current);
+void find_splits(utree &T, fingerprint_set &splits);
+bool find_agreement_forest_cuts(uforest &T, uforest &T2, int tbr, vector<pair<unode *, unode *> > &cuts);
+vector<int> find_agreement_forest_cuts_hlpr(unode *n, unode *prev, vector<int> &components, int num_components, vector<int> &sizes, vector<pair<unode *, unode *> > &cuts);
+template <typename V>
+bool visit_guided_neighbors(uforest &T, uforest &T2, int tbr, fingerprint_set &target_splits, V visitor);
+void uspr_parallel_receive(uspr_parallel_search &s, uspr_worker &w, const tree_fingerprint &f, int cost, const vector<int> &encoding);
+void uspr_parallel_expand(uspr_parallel_search &s, int id);
+void uspr_parallel_worker(uspr_parallel_search *s, int id);
 
 // functions
 int uspr_distance(uforest &T1_original, uforest &T2_original) {
@@ -144,75 +557,127 @@ int uspr_distance(uforest &T1_original, uforest &T2_original) {
 		cout << "T2R: " << T2 << endl;
 	)
 
+	if (IDA_SEARCH) {
+		return uspr_distance_ida(T1, T2);
+	}
+	if (BIDIRECTIONAL_SEARCH) {
+		return uspr_distance_bidirectional(T1, T2);
+	}
+	if (NUM_THREADS > 1 && !SCORE_NEIGHBORS && !GUIDED_MOVES) {
+		return uspr_distance_parallel(T1, T2);
+	}
 
-	// set of visited trees
-	set<string> visited_trees = set<string>();
-
-	// target string
-	string target = utree(T2).str();
+	// target encoding
+	vector<int> target = vector<int>();
+	T2.encode(target);
 
 
 	// priority queue of trees
-	multiset<tree_distance> distance_priority_queue = multiset<tree_distance>();
+	distance_queue distance_priority_queue = distance_queue();
+
+	// trees referenced by the queue
+	tree_store trees = tree_store();
 
+	// set of visited trees
+	tree_set visited_trees = tree_set(&trees);
 
 	// start with the first distance
-	visited_trees.insert(T1.str());
-	distance_priority_queue.insert(tree_distance(0, 1, utree(T1).str(), BFS));
+	vector<int> encoding = vector<int>();
+	T1.encode(encoding);
+	distance_priority_queue.insert(tree_distance(0, 1, visited_trees.insert(T1.fingerprint(), encoding), BFS));
 
 
 
 	// final estimator
-	estimator_t final_estimator = BFS;
-	if (USE_TBR_APPROX_ESTIMATE) {
-		final_estimator = TBR_APPROX;
+	estimator_t final_estimator = get_final_estimator();
+
+	// splits of the target, to find the guided moves
+	bool guided_moves = GUIDED_MOVES && final_estimator != BFS &&
+			USE_TBR_ESTIMATE;
+	fingerprint_set target_splits = fingerprint_set();
+	if (guided_moves) {
+		find_splits(T2, target_splits);
 	}
-	if (USE_TBR_ESTIMATE) {
-		final_estimator = TBR;
+
+	// neighbors of partially expanded trees that have not been queued
+	map<int, vector<int> > deferred_trees = map<int, vector<int> >();
+
+	// score neighbors as they are generated, one copy of T2 per thread
+	// as replug_distance modifies its arguments
+	bool score_neighbors = SCORE_NEIGHBORS && final_estimator != BFS;
+	unique_ptr<thread_pool> pool;
+	vector<uforest> pool_targets = vector<uforest>();
+	if (score_neighbors) {
+		pool.reset(new thread_pool(NUM_THREADS));
+		for (int i = 0; i < pool->size(); i++) {
+			pool_targets.push_back(uforest(T2));
+		}
 	}
-	if (USE_REPLUG_ESTIMATE) {
-		final_estimator = REPLUG;
+
+	// anytime search: stop at the time or node limit and report the
+	// bounds found so far, printing them whenever they improve
+	bool anytime = (TIME_LIMIT > 0 || NODE_LIMIT > 0);
+	chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+	int lower_bound = 1;
+	int upper_bound = INT_MAX;
+	if (score_neighbors || anytime) {
+		// the uSPR distance is at most twice the TBR distance
+		upper_bound = 2 * tbr_low_upper_bound(T1, T2);
+	}
+	if (anytime) {
+		cout << lower_bound << " <= d_USPR <= " << upper_bound << endl;
 	}
 
 	// explore the next tree
 	while (!distance_priority_queue.empty()) {
-		multiset<tree_distance>::iterator it = distance_priority_queue.begin();
+		if (anytime) {
+			// the smallest distance in the queue is a lower bound
+			int queue_bound = distance_priority_queue.top_distance();
+			if (queue_bound > lower_bound) {
+				lower_bound = queue_bound;
+				cout << lower_bound << " <= d_USPR <= " << upper_bound << endl;
+			}
+			if (lower_bound >= upper_bound) {
+				cout << "examined " << visited_trees.size() << " trees" << endl;
+				return upper_bound;
+			}
+			chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+			if ((TIME_LIMIT > 0 && elapsed.count() >= TIME_LIMIT) ||
+					(NODE_LIMIT > 0 && visited_trees.size() >= (size_t)NODE_LIMIT)) {
+				cout << "search limit reached after examining " << visited_trees.size() << " trees" << endl;
+				cout << lower_bound << " <= d_USPR <= " << upper_bound << endl;
+				return -1;
+			}
+		}
+
+		// remove the old entry
+		tree_distance current = distance_priority_queue.pop();
 
 		// debugging
 		debug_uspr(
-			cout << it->distance << ": " << it->cost << " + " << it->estimate << " using " << estimator_t_name[it->estimator] << endl;
-			cout << "\t" << it->tree << endl;
+			cout << current.distance << ": " << current.cost << " + " << current.estimate << " using " << estimator_t_name[current.estimator] << endl;
 		)
 
-		// remove the old entry
-		int cost = it->cost;
-		string tree = it->tree;
-		estimator_t prev_estimator = it->estimator;
-		distance_priority_queue.erase(it);
+		int cost = current.cost;
+		int tree = current.tree;
+		estimator_t prev_estimator = current.estimator;
 
-		// build the tree
-		uforest T = uforest(tree);
-		distances_from_leaf_decorator(T, T.get_smallest_leaf());
-		T.normalize_order();
+		// rebuild the tree, the encoding is already normalized
+		uforest T = uforest(trees.get(tree), trees.get_tree_size());
+		debug_uspr(
+			cout << "\t" << T.str() << endl;
+		)
 
 		// check if the distance estimate is final
 		if (prev_estimator != final_estimator) {
 			// if not, compute the next estimate and insert it into the queue
-			int distance = 1;
-			if (prev_estimator > TBR_APPROX &&
-					USE_TBR_APPROX_ESTIMATE) {
-				distance = tbr_high_lower_bound(T, T2);
-				distance_priority_queue.insert(tree_distance(cost, distance, tree, TBR_APPROX));
-			}
-			else if (prev_estimator > TBR &&
-					USE_TBR_ESTIMATE) {
-				distance = tbr_distance(T, T2);
-				distance_priority_queue.insert(tree_distance(cost, distance, tree, TBR));
-			}
-			else if (prev_estimator > REPLUG &&
-					USE_REPLUG_ESTIMATE) {
-				distance = replug_distance(T, T2);
-				distance_priority_queue.insert(tree_distance(cost, distance, tree, REPLUG));
+			int distance = current.estimate;
+			estimator_t estimator = next_estimate(T, T2, prev_estimator, distance, current.parent_tbr, current.parent_replug);
+			distance_priority_queue.insert(tree_distance(current, distance, estimator));
+			// reaching T and then applying two SPRs per TBR gives an upper bound
+			if (anytime && estimator == TBR && cost + 2 * distance < upper_bound) {
+				upper_bound = cost + 2 * distance;
+				cout << lower_bound << " <= d_USPR <= " << upper_bound << endl;
 			}
 			continue;
 		}
@@ -227,28 +692,574 @@ int uspr_distance(uforest &T1_original, uforest &T2_original) {
 			// if not then insert it into the queue (initial BFS - cost + 1)
 			// TODO: stop immediately if we find T2?
 
-		list<utree> neighbors = get_neighbors(&T, &visited_trees);
-		debug_uspr(
-			cout << "examining " << neighbors.size() << " neighbors" << endl;
-		)
-		for (utree tree : neighbors) {
-			string tree_string = tree.str();
-//			cout << "neighbor: " << tree_string << endl;
-//			cout << "target: " << target << endl;
-				if (tree_string == target) {
-//					cout << "returning " << cost+1 << endl;
-					cout << "examined " << visited_trees.size() << " trees" << endl;
-					return cost+1;
+		// every new neighbor is marked as visited, even after the target
+		// is found, so the number of examined trees matches a full
+		// expansion
+		bool found = false;
+		vector<int> unscored = vector<int>();
+		size_t num_visited = visited_trees.size();
+		auto add_tree = [&](int neighbor_tree) {
+			if (score_neighbors) {
+				unscored.push_back(neighbor_tree);
+			}
+			else {
+				distance_priority_queue.insert(current.child(neighbor_tree));
+			}
+		};
+		// returns the handle of a new neighbor, or -1 if it was already
+		// visited or is the target
+		auto visit_neighbor = [&](const spr_neighbor &neighbor) {
+			encoding.clear();
+			neighbor.tree->encode(encoding);
+			int neighbor_tree = visited_trees.insert(neighbor.fingerprint, encoding);
+			if (neighbor_tree < 0 || found) {
+				return -1;
+			}
+			if (trees.equals(neighbor_tree, target)) {
+				found = true;
+				return -1;
+			}
+			return neighbor_tree;
+		};
+		auto add_neighbor = [&](const spr_neighbor &neighbor) {
+			int neighbor_tree = visit_neighbor(neighbor);
+			if (neighbor_tree >= 0) {
+				add_tree(neighbor_tree);
+			}
+		};
+		// partial expansion: queue the guided moves first and requeue the
+		// tree with the same distance. Every neighbor's distance is at
+		// least the tree's, so the remaining neighbors are only queued if
+		// nothing better is found first. They are marked as visited now,
+		// at their true cost, so a longer path cannot close them first
+		if (guided_moves && !current.guided &&
+				visit_guided_neighbors(T, T2, current.tbr, target_splits, add_neighbor) &&
+				visited_trees.size() > num_visited && !found) {
+			vector<int> &rest_trees = deferred_trees[tree];
+			visit_neighbors(&T, [&](const spr_neighbor &neighbor) {
+				int neighbor_tree = visit_neighbor(neighbor);
+				if (neighbor_tree >= 0) {
+					rest_trees.push_back(neighbor_tree);
 				}
-//				else {
-//					cout << "cond: " << (tree_string == target) << endl;
-//				}
-				distance_priority_queue.insert(tree_distance(cost+1, 1, tree_string, BFS));
+			});
+			tree_distance rest = current;
+			rest.guided = true;
+			distance_priority_queue.insert(rest);
+		}
+		else if (current.guided) {
+			for (int neighbor_tree : deferred_trees[tree]) {
+				add_tree(neighbor_tree);
+			}
+			deferred_trees.erase(tree);
+		}
+		else {
+			visit_neighbors(&T, add_neighbor);
+		}
+		if (found) {
+			cout << "examined " << visited_trees.size() << " trees" << endl;
+			return cost+1;
+		}
+
+		// score the batch with the first estimator and drop trees that
+		// cannot be on a shortest path
+		if (!unscored.empty()) {
+			vector<int> estimates = vector<int>(unscored.size());
+			vector<estimator_t> estimators = vector<estimator_t>(unscored.size());
+			pool->parallel_for(unscored.size(), [&](int i, int thread_id) {
+				uforest F = uforest(trees.get(unscored[i]), trees.get_tree_size());
+				estimators[i] = next_estimate(F, pool_targets[thread_id], BFS, estimates[i]);
+			});
+			for (size_t i = 0; i < unscored.size(); i++) {
+				if (cost + 1 + estimates[i] <= upper_bound) {
+					distance_priority_queue.insert(tree_distance(current.child(unscored[i]), estimates[i], estimators[i]));
+				}
+			}
+		}
+
+	}
+
+	return -1;
+}
+
+estimator_t get_final_estimator() {
+	estimator_t final_estimator = BFS;
+	if (USE_TBR_APPROX_ESTIMATE) {
+		final_estimator = TBR_APPROX;
+	}
+	if (USE_TBR_ESTIMATE) {
+		final_estimator = TBR;
+	}
+	if (USE_REPLUG_ESTIMATE) {
+		final_estimator = REPLUG;
+	}
+	return final_estimator;
+}
+
+// compute the estimate that follows prev_estimator
+// prev_estimator must not be the final estimator
+// a cached estimate is used instead if it is better than prev_estimator
+// distance is the previous estimate on input. If the distances of a tree
+// one SPR away are known they bound the new estimate to within one, so
+// only the values in that window are tested
+estimator_t next_estimate(uforest &T, uforest &T2, estimator_t prev_estimator, int &distance, int parent_tbr /* = -1 */, int parent_replug /* = -1 */) {
+	tree_fingerprint key = tree_fingerprint();
+	if (ESTIMATE_CACHE.enabled()) {
+		key = estimate_cache::get_key(T.fingerprint(), T2.fingerprint());
+		int cached_distance;
+		estimator_t cached_estimator;
+		if (ESTIMATE_CACHE.lookup(key, cached_distance, cached_estimator) &&
+				cached_estimator < prev_estimator &&
+				cached_estimator >= get_final_estimator()) {
+			distance = cached_distance;
+			return cached_estimator;
+		}
+	}
+	estimator_t estimator = prev_estimator;
+	if (prev_estimator > TBR_APPROX &&
+			USE_TBR_APPROX_ESTIMATE) {
+		distance = tbr_high_lower_bound(T, T2);
+		estimator = TBR_APPROX;
+	}
+	else if (prev_estimator > TBR &&
+			USE_TBR_ESTIMATE) {
+		if (parent_tbr >= 0) {
+			distance = tbr_distance_range(T, T2, max(distance, parent_tbr - 1), parent_tbr + 1);
+		}
+		else {
+			distance = tbr_distance(T, T2);
+		}
+		estimator = TBR;
+	}
+	else if (prev_estimator > REPLUG &&
+			USE_REPLUG_ESTIMATE) {
+		if (parent_replug >= 0) {
+			distance = replug_distance_range(T, T2, max(distance, parent_replug - 1), parent_replug + 1);
+		}
+		else {
+			distance = replug_distance(T, T2);
+		}
+		estimator = REPLUG;
+	}
+	if (ESTIMATE_CACHE.enabled() && estimator != prev_estimator) {
+		ESTIMATE_CACHE.insert(key, distance, estimator);
+	}
+	return estimator;
+}
+
+// pop the best entry of a frontier
+// entries superseded by a cheaper path are dropped and entries without a
+// final estimate are re-queued with the next estimate. Returns true if
+// current is ready to be expanded
+bool next_expansion(search_frontier &side, estimator_t final_estimator, tree_distance &current) {
+	current = side.open.pop();
+	int tree = current.tree;
+	if (side.closed.get(side.fingerprints[tree]) < current.cost) {
+		return false;
+	}
+	if (current.estimator != final_estimator) {
+		uforest T = uforest(side.trees.get(tree), side.trees.get_tree_size());
+		int distance = current.estimate;
+		estimator_t estimator = next_estimate(T, side.target, current.estimator, distance, current.parent_tbr, current.parent_replug);
+		side.open.insert(tree_distance(current, distance, estimator));
+		return false;
+	}
+	return true;
+}
+
+// the splits of T, as the split fingerprints of its edges
+void find_splits(utree &T, fingerprint_set &splits) {
+	utree S = utree(T);
+	S.track_fingerprint();
+	unode *root = S.get_node(S.get_smallest_leaf());
+	for (unode *n : S.get_node_list()) {
+		if (n != root) {
+			splits.insert(split_fingerprint(n->get_clade()));
+		}
+	}
+}
+
+// find the edges of T that are cut to obtain a maximum agreement forest
+// of T and T2, given their TBR distance tbr if known. These are the edges
+// of T outside the subtrees spanning each component. Returns false if no
+// forest was found
+bool find_agreement_forest_cuts(uforest &T, uforest &T2, int tbr, vector<pair<unode *, unode *> > &cuts) {
+	bool old_value = OPTIMIZE_2B;
+	// always safe for the TBR distance
+	OPTIMIZE_2B = true;
+	uforest *MAF1 = NULL;
+	uforest *MAF2 = NULL;
+	if (tbr >= 0) {
+		tbr_distance_hlpr(T, T2, tbr, 0, &dummy_mAFs, &MAF1, &MAF2);
+	}
+	else {
+		tbr_distance(T, T2, true, &MAF1, &MAF2);
+	}
+	OPTIMIZE_2B = old_value;
+	if (MAF1 == NULL) {
+		return false;
+	}
+
+	// component of each leaf
+	vector<int> components = vector<int>(T.num_leaves(), -1);
+	vector<unode *> roots = MAF1->get_components();
+	vector<int> sizes = vector<int>(roots.size());
+	for (size_t i = 0; i < roots.size(); i++) {
+		list<unode *> nodes = list<unode *>();
+		roots[i]->get_connected_nodes(nodes);
+		for (unode *n : nodes) {
+			if (n->get_label() >= 0 && components[n->get_label()] == -1) {
+				components[n->get_label()] = i;
+				sizes[i]++;
+			}
+		}
+	}
+	delete MAF1;
+	if (MAF2 != NULL) {
+		delete MAF2;
+	}
+
+	unode *root = T.get_node(T.get_smallest_leaf());
+	find_agreement_forest_cuts_hlpr(root->get_neighbors().front(), root,
+			components, roots.size(), sizes, cuts);
+	return true;
+}
+
+// count the leaves of each component below n, adding the edge (prev, n)
+// to cuts if it does not separate the leaves of any component
+vector<int> find_agreement_forest_cuts_hlpr(unode *n, unode *prev, vector<int> &components, int num_components, vector<int> &sizes, vector<pair<unode *, unode *> > &cuts) {
+	vector<int> counts = vector<int>(num_components);
+	if (n->is_leaf()) {
+		if (components[n->get_label()] >= 0) {
+			counts[components[n->get_label()]]++;
+		}
+	}
+	else {
+		for (unode *c : n->get_neighbors()) {
+			if (c != prev) {
+				vector<int> c_counts = find_agreement_forest_cuts_hlpr(c, n, components, num_components, sizes, cuts);
+				for (int i = 0; i < num_components; i++) {
+					counts[i] += c_counts[i];
+				}
+			}
+		}
+	}
+	// the edge to the root leaf joins its component to the rest
+	bool cut = true;
+	for (int i = 0; i < num_components; i++) {
+		if (counts[i] > 0 && counts[i] < sizes[i]) {
+			cut = false;
+			break;
+		}
+	}
+	if (cut) {
+		cuts.push_back(make_pair(prev, n));
+	}
+	return counts;
+}
+
+// call visitor for the SPR neighbors of T that prune an edge cut by a
+// maximum agreement forest of T and T2 and whose regrafted subtree forms
+// a split of T2 with its new sibling. Returns false if no forest was found
+template <typename V>
+bool visit_guided_neighbors(uforest &T, uforest &T2, int tbr, fingerprint_set &target_splits, V visitor) {
+	vector<pair<unode *, unode *> > cuts = vector<pair<unode *, unode *> >();
+	if (!find_agreement_forest_cuts(T, T2, tbr, cuts)) {
+		return false;
+	}
+	T.track_fingerprint();
+	auto guided_visitor = [&](const spr_neighbor &neighbor) {
+		// y's edge to its parent is the only new split
+		if (target_splits.contains(split_fingerprint(neighbor.y->get_clade()))) {
+			visitor(neighbor);
+		}
+	};
+	for (pair<unode *, unode *> &e : cuts) {
+		unode *a = e.first;
+		unode *b = e.second;
+		if (!b->is_leaf()) {
+			visit_neighbors(&T, a, b, a, b, guided_visitor);
+		}
+		if (!a->is_leaf()) {
+			visit_neighbors(&T, b, a, b, a, guided_visitor);
 		}
+	}
+	return true;
+}
+
+// bidirectional A* search
+// searches forward from T1 with estimates to T2 and backward from T2 with
+// estimates to T1, expanding the side with the smaller open list. The best
+// path is updated whenever a tree is reached by both sides and the search
+// stops once it is no longer than the smallest distance on either side
+int uspr_distance_bidirectional(uforest &T1, uforest &T2) {
+	search_frontier forward = search_frontier(T2);
+	search_frontier backward = search_frontier(T1);
+	estimator_t final_estimator = get_final_estimator();
+	int best = INT_MAX;
+
+	vector<int> encoding = vector<int>();
+	T1.encode(encoding);
+	forward.add(T1.fingerprint(), 0, encoding);
+	encoding.clear();
+	T2.encode(encoding);
+	backward.add(T2.fingerprint(), 0, encoding);
+
+	while (!forward.open.empty() && !backward.open.empty()) {
+		int bound = max(forward.open.top_distance(), backward.open.top_distance());
+		if (best <= bound) {
+			break;
+		}
+		bool use_forward = (forward.open.size() <= backward.open.size());
+		search_frontier &side = use_forward ? forward : backward;
+		search_frontier &other = use_forward ? backward : forward;
+
+		tree_distance current = tree_distance(0, 0, 0, BFS);
+		if (!next_expansion(side, final_estimator, current)) {
+			continue;
+		}
+		int cost = current.cost + 1;
+		if (cost >= best) {
+			continue;
+		}
+
+		uforest T = uforest(side.trees.get(current.tree), side.trees.get_tree_size());
+		visit_neighbors(&T, [&](const spr_neighbor &neighbor) {
+			const tree_fingerprint &f = neighbor.fingerprint;
+			int closed_cost = side.closed.get(f);
+			if (closed_cost >= 0 && closed_cost <= cost) {
+				return;
+			}
+			encoding.clear();
+			neighbor.tree->encode(encoding);
+			if (!side.add(f, cost, encoding)) {
+				return;
+			}
+			int other_cost = other.closed.get(f);
+			if (other_cost >= 0 && cost + other_cost < best) {
+				best = cost + other_cost;
+			}
+		});
+	}
 
+	if (best == INT_MAX) {
+		return -1;
 	}
+	cout << "examined " << forward.closed.size() + backward.closed.size() << " trees" << endl;
+	return best;
+}
 
+// iterative deepening A* search
+// memory is limited to the neighborhoods along the current path and a
+// bounded table of the lowest cost each tree was reached with in the
+// current iteration
+int uspr_distance_ida(uforest &T1, uforest &T2) {
+	vector<int> target = vector<int>();
+	T2.encode(target);
+	estimator_t final_estimator = get_final_estimator();
+	fingerprint_map table = fingerprint_map();
+	long examined = 0;
+	int threshold = 1;
+	while (threshold < INT_MAX) {
+		int next_threshold = INT_MAX;
+		table.clear();
+		table.insert_min(T1.fingerprint(), 0);
+		int result = uspr_ida_hlpr(T1, T2, target, 0, threshold, next_threshold, final_estimator, table, examined);
+		if (result >= 0) {
+			cout << "examined " << examined << " trees" << endl;
+			return result;
+		}
+		threshold = next_threshold;
+	}
 	return -1;
 }
 
+// search below T for the target within threshold
+// returns the distance found or -1
+int uspr_ida_hlpr(uforest &T, uforest &T2, vector<int> &target, int cost, int threshold, int &next_threshold, estimator_t final_estimator, fingerprint_map &table, long &examined) {
+	examined++;
+
+	// compute estimates in order, stopping once one exceeds the threshold
+	int estimate = 1;
+	estimator_t estimator = BFS;
+	while (true) {
+		if (cost + estimate > threshold) {
+			if (cost + estimate < next_threshold) {
+				next_threshold = cost + estimate;
+			}
+			return -1;
+		}
+		if (estimator == final_estimator) {
+			break;
+		}
+		estimator = next_estimate(T, T2, estimator, estimate);
+	}
+
+	// encode the neighbors back to back as T is reused by the recursion
+	vector<int> encodings = vector<int>();
+	vector<tree_fingerprint> fingerprints = vector<tree_fingerprint>();
+	bool found = false;
+	visit_neighbors(&T, [&](const spr_neighbor &neighbor) {
+		if (found) {
+			return;
+		}
+		int start = encodings.size();
+		neighbor.tree->encode(encodings);
+		if (equal(target.begin(), target.end(), encodings.begin() + start)) {
+			found = true;
+		}
+		fingerprints.push_back(neighbor.fingerprint);
+	});
+	if (found) {
+		return cost + 1;
+	}
+	int tree_size = target.size();
+	for (size_t i = 0; i < fingerprints.size(); i++) {
+		// skip trees already reached as cheaply in this iteration
+		const tree_fingerprint &f = fingerprints[i];
+		int previous_cost = table.get(f);
+		if (previous_cost >= 0 && previous_cost <= cost + 1) {
+			continue;
+		}
+		if (previous_cost >= 0 || table.size() < (size_t)IDA_TABLE_SIZE) {
+			table.insert_min(f, cost + 1);
+		}
+		uforest F = uforest(&encodings[i * tree_size], tree_size);
+		int result = uspr_ida_hlpr(F, T2, target, cost + 1, threshold, next_threshold, final_estimator, table, examined);
+		if (result >= 0) {
+			return result;
+		}
+	}
+	return -1;
+}
+
+// hash distributed A* search
+// each tree is owned by the worker selected by its fingerprint. Workers
+// expand their own trees and send generated trees to their owners, which
+// keep the lowest cost seen and reopen a tree when a cheaper path arrives.
+// The search stops once no worker has an entry with distance below the
+// best path found and no messages are in flight, so the result is optimal
+int uspr_distance_parallel(uforest &T1, uforest &T2) {
+	uspr_parallel_search s;
+	s.target = vector<int>();
+	T2.encode(s.target);
+	s.final_estimator = get_final_estimator();
+	s.upper_bound = INT_MAX;
+	s.outstanding = NUM_THREADS;
+	s.workers = vector<uspr_worker *>();
+	for (int i = 0; i < NUM_THREADS; i++) {
+		s.workers.push_back(new uspr_worker(T2));
+	}
+
+	// start with the first tree
+	vector<int> start = vector<int>();
+	T1.encode(start);
+	tree_fingerprint f = T1.fingerprint();
+	uspr_parallel_receive(s, *s.workers[f.high % NUM_THREADS], f, 0, start);
+
+	vector<thread> threads = vector<thread>();
+	for (int i = 0; i < NUM_THREADS; i++) {
+		threads.push_back(thread(uspr_parallel_worker, &s, i));
+	}
+	for (thread &t : threads) {
+		t.join();
+	}
+
+	size_t examined = 0;
+	for (uspr_worker *w : s.workers) {
+		examined += w->closed.size();
+		delete w;
+	}
+
+	if (s.upper_bound == INT_MAX) {
+		return -1;
+	}
+	cout << "examined " << examined << " trees" << endl;
+	return s.upper_bound;
+}
+
+// record a tree reached with the given cost
+void uspr_parallel_receive(uspr_parallel_search &s, uspr_worker &w, const tree_fingerprint &f, int cost, const vector<int> &encoding) {
+	// every tree other than the target is at least one move away
+	if (cost + 1 >= s.upper_bound) {
+		return;
+	}
+	w.add(f, cost, encoding);
+}
+
+// process the best entry of worker id
+void uspr_parallel_expand(uspr_parallel_search &s, int id) {
+	uspr_worker &w = *s.workers[id];
+	tree_distance current = tree_distance(0, 0, 0, BFS);
+	if (!next_expansion(w, s.final_estimator, current)) {
+		return;
+	}
+	int cost = current.cost;
+
+	uforest T = uforest(w.trees.get(current.tree), w.trees.get_tree_size());
+	vector<int> encoding = vector<int>();
+	visit_neighbors(&T, [&](const spr_neighbor &neighbor) {
+		encoding.clear();
+		neighbor.tree->encode(encoding);
+		if (encoding == s.target) {
+			int best = s.upper_bound;
+			while (cost + 1 < best &&
+					!s.upper_bound.compare_exchange_weak(best, cost + 1)) {
+			}
+			return;
+		}
+		const tree_fingerprint &f = neighbor.fingerprint;
+		int owner = f.high % s.workers.size();
+		if (owner == id) {
+			uspr_parallel_receive(s, w, f, cost + 1, encoding);
+		}
+		else {
+			tree_message *m = new tree_message();
+			m->fingerprint = f;
+			m->cost = cost + 1;
+			m->encoding = encoding;
+			s.outstanding++;
+			s.workers[owner]->inbox.push(m);
+		}
+	});
+}
+
+void uspr_parallel_worker(uspr_parallel_search *s, int id) {
+	uspr_worker &w = *s->workers[id];
+	bool active = true;
+	while (true) {
+		tree_message *m = w.inbox.take_all();
+		if (m != NULL) {
+			if (!active) {
+				s->outstanding++;
+				active = true;
+			}
+			long received = 0;
+			while (m != NULL) {
+				uspr_parallel_receive(*s, w, m->fingerprint, m->cost, m->encoding);
+				tree_message *next = m->next;
+				delete m;
+				m = next;
+				received++;
+			}
+			s->outstanding -= received;
+		}
+		if (!w.open.empty() && w.open.top_distance() < s->upper_bound) {
+			if (!active) {
+				s->outstanding++;
+				active = true;
+			}
+			uspr_parallel_expand(*s, id);
+			continue;
+		}
+		if (active) {
+			active = false;
+			s->outstanding--;
+		}
+		if (s->outstanding == 0) {
+			break;
+		}
+		this_thread::yield();
+	}
+}
+
 #endif
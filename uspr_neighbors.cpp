@@ -51,6 +51,14 @@ using namespace std;
 //
 bool IGNORE_ORIGINAL = false;
 bool SIZE_ONLY = false;
+int NEIGHBOR_THREADS = 1;
+int RADIUS = 1;
+bool NNI_MOVES = false;
+bool TBR_MOVES = false;
+bool BINARY = false;
+bool READ_BINARY = false;
+// bytes of output each thread buffers before writing
+const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
 
 string USAGE =
 "uspr_neighbors, version 1.0.1\n"
@@ -76,7 +84,26 @@ string USAGE =
 "\n"
 "--ignore_original      Do not output or count the input tree.\n"
 "\n"
-"--size_only            Count the number of SPR neighbors instead of printing them.\n";
+"--size_only            Count the number of SPR neighbors instead of printing them.\n"
+"\n"
+"--nni                  Use NNI moves instead of SPR moves.\n"
+"\n"
+"--tbr                  Use TBR moves instead of SPR moves.\n"
+"\n"
+"--radius r             Output every tree within r SPR moves followed by its\n"
+"                       SPR distance, or count the trees at each distance with\n"
+"                       --size_only. Uses one thread and cannot be combined with\n"
+"                       --nni or --tbr.\n"
+"\n"
+"--threads N            Split the SPR neighborhood between N threads. The neighbors\n"
+"                       are printed in no particular order.\n"
+"\n"
+"--binary               Write the neighbors in the binary format described in\n"
+"                       uspr_neighbors.h. SPR and NNI neighbors are written as\n"
+"                       moves, TBR and --radius neighbors as tree encodings.\n"
+"\n"
+"--read_binary          Read a file written with --binary from STDIN and print its\n"
+"                       trees, followed by their SPR distance for tree encodings.\n";
 
 // function prototypes
 
@@ -88,6 +115,34 @@ int main(int argc, char *argv[]) {
 		if (strcmp(arg, "--size_only") == 0) {
 			SIZE_ONLY = true;
 		}
+		else if (strcmp(arg, "--nni") == 0) {
+			NNI_MOVES = true;
+		}
+		else if (strcmp(arg, "--tbr") == 0) {
+			TBR_MOVES = true;
+		}
+		else if (strcmp(arg, "--radius") == 0) {
+			if (max_args > argc) {
+				char *arg2 = argv[argc+1];
+				if (arg2[0] != '-') {
+					RADIUS = atoi(arg2);
+				}
+			}
+		}
+		else if (strcmp(arg, "--threads") == 0) {
+			if (max_args > argc) {
+				char *arg2 = argv[argc+1];
+				if (arg2[0] != '-') {
+					NEIGHBOR_THREADS = atoi(arg2);
+				}
+			}
+		}
+		else if (strcmp(arg, "--binary") == 0) {
+			BINARY = true;
+		}
+		else if (strcmp(arg, "--read_binary") == 0) {
+			READ_BINARY = true;
+		}
 		else if (strcmp(arg, "--ignore_original") == 0) {
 			IGNORE_ORIGINAL = true;
 		}
@@ -99,6 +154,11 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (RADIUS > 1 && (NNI_MOVES || TBR_MOVES)) {
+		cerr << "--radius only supports SPR moves, not --nni or --tbr" << endl;
+		return 1;
+	}
+
 	// label maps to allow string labels
 	map<string, int> label_map= map<string, int>();
 	map<int, string> reverse_label_map = map<int, string>();
@@ -106,26 +166,175 @@ int main(int argc, char *argv[]) {
 	// set random seed
 	srand(unsigned(time(0)));
 
+	unique_ptr<thread_pool> pool;
+	if (NEIGHBOR_THREADS > 1) {
+		pool.reset(new thread_pool(NEIGHBOR_THREADS));
+	}
+
+	// decode a binary neighbor file
+	if (READ_BINARY) {
+		neighbor_reader reader(cin);
+		while (reader.read_header()) {
+			if (!IGNORE_ORIGINAL) {
+				uforest F = uforest(&reader.original[0], reader.original.size());
+				cout << F.str(false, &reader.taxa) << endl;
+			}
+			neighbor_record r = neighbor_record();
+			while (reader.read_record(r)) {
+				utree T = reader.tree(r);
+				if (T.fingerprint() != r.fingerprint) {
+					cerr << "fingerprint does not match " << T.str(false, &reader.taxa) << endl;
+				}
+				cout << T.str(false, &reader.taxa);
+				if (reader.record_type == TREE_RECORDS) {
+					cout << "\t" << r.distance;
+				}
+				cout << "\n";
+			}
+		}
+		cout.flush();
+		return 0;
+	}
+
 	// read input trees
 	string T_line = "";
 	while (getline(cin, T_line)) {
 		// load into data structures
 		uforest F1 = uforest(T_line, &label_map, &reverse_label_map);
 		F1.normalize_order();
-		if (!IGNORE_ORIGINAL) {
+		vector<int> encoding = vector<int>();
+		if (BINARY && !SIZE_ONLY) {
+			// rebuild from the encoding so readers see the same labels
+			F1.encode(encoding);
+			F1 = uforest(&encoding[0], encoding.size());
+		}
+		else if (!IGNORE_ORIGINAL) {
 			cout << F1.str(false, &reverse_label_map) << endl;
 		}
 
 		// compute neighbors
-		list<utree> neighbors = get_neighbors(&F1);
-		if (SIZE_ONLY) {
-			int size = neighbors.size();
+		if (BINARY && !SIZE_ONLY) {
+			neighbor_record_t record_type = MOVE_RECORDS;
+			if (TBR_MOVES || RADIUS > 1) {
+				record_type = TREE_RECORDS;
+			}
+			string header = string();
+			append_neighbor_header(header, &F1, &reverse_label_map, record_type);
+			cout.write(header.data(), header.size());
+			mutex output_lock;
+			int num_buffers = 1;
+			if (pool) {
+				num_buffers = pool->size();
+			}
+			vector<string> buffers = vector<string>(num_buffers);
+			auto emit = [&](const spr_neighbor &n, int distance, int thread_id) {
+				string &buffer = buffers[thread_id];
+				if (record_type == MOVE_RECORDS) {
+					append_move_record(buffer, n);
+				}
+				else {
+					append_tree_record(buffer, n, distance);
+				}
+				if (buffer.size() >= OUTPUT_BUFFER_SIZE) {
+					lock_guard<mutex> guard(output_lock);
+					cout.write(buffer.data(), buffer.size());
+					buffer.clear();
+				}
+			};
+			if (NNI_MOVES) {
+				visit_nni_neighbors(&F1, [&](const spr_neighbor &n) {
+					emit(n, 1, 0);
+				});
+			}
+			else if (TBR_MOVES) {
+				visit_tbr_neighbors(&F1, [&](const spr_neighbor &n) {
+					emit(n, 1, 0);
+				});
+			}
+			else if (RADIUS > 1) {
+				visit_neighborhood(&F1, RADIUS, [&](const spr_neighbor &n, int distance) {
+					emit(n, distance, 0);
+				});
+			}
+			else if (pool) {
+				visit_neighbors_parallel(&F1, *pool, [&](const spr_neighbor &n, int thread_id) {
+					emit(n, 1, thread_id);
+				});
+			}
+			else {
+				visit_neighbors(&F1, [&](const spr_neighbor &n) {
+					emit(n, 1, 0);
+				});
+			}
+			append_end_record(buffers.back(), record_type, encoding.size());
+			for (string &buffer : buffers) {
+				cout.write(buffer.data(), buffer.size());
+			}
+			cout.flush();
+		}
+		else if (NNI_MOVES && SIZE_ONLY) {
+			cout << nni_neighborhood_size(&F1) << " neighbors" << endl;
+		}
+		else if (NNI_MOVES) {
+			visit_nni_neighbors(&F1, [&](const spr_neighbor &n) {
+				cout << n.tree->str(false, &reverse_label_map) << "\n";
+			});
+			cout.flush();
+		}
+		else if (TBR_MOVES && SIZE_ONLY) {
+			long size = 0;
+			visit_tbr_neighbors(&F1, [&](const spr_neighbor &n) {
+				size++;
+			});
 			cout << size << " neighbors" << endl;
 		}
-		else {
-			for (utree T: neighbors) {
-				cout << T.str(false, &reverse_label_map) << endl;
+		else if (TBR_MOVES) {
+			visit_tbr_neighbors(&F1, [&](const spr_neighbor &n) {
+				cout << n.tree->str(false, &reverse_label_map) << "\n";
+			});
+			cout.flush();
+		}
+		else if (RADIUS > 1 && SIZE_ONLY) {
+			vector<long> sizes = vector<long>(RADIUS + 1);
+			visit_neighborhood(&F1, RADIUS, [&](const spr_neighbor &n, int distance) {
+				sizes[distance]++;
+			}, false);
+			for (int d = 1; d <= RADIUS; d++) {
+				cout << sizes[d] << " neighbors at distance " << d << endl;
+			}
+		}
+		else if (RADIUS > 1) {
+			visit_neighborhood(&F1, RADIUS, [&](const spr_neighbor &n, int distance) {
+				cout << n.tree->str(false, &reverse_label_map) << "\t" << distance << "\n";
+			});
+			cout.flush();
+		}
+		else if (SIZE_ONLY) {
+			cout << spr_neighborhood_size(&F1) << " neighbors" << endl;
+		}
+		else if (pool) {
+			// each thread writes whole lines from its own buffer
+			mutex output_lock;
+			vector<string> buffers = vector<string>(pool->size());
+			visit_neighbors_parallel(&F1, *pool, [&](const spr_neighbor &n, int thread_id) {
+				string &buffer = buffers[thread_id];
+				buffer += n.tree->str(false, &reverse_label_map);
+				buffer += '\n';
+				if (buffer.size() >= OUTPUT_BUFFER_SIZE) {
+					lock_guard<mutex> guard(output_lock);
+					cout << buffer;
+					buffer.clear();
+				}
+			});
+			for (string &buffer : buffers) {
+				cout << buffer;
 			}
+			cout.flush();
+		}
+		else {
+			visit_neighbors(&F1, [&](const spr_neighbor &n) {
+				cout << n.tree->str(false, &reverse_label_map) << endl;
+			});
 		}
 	}
 }
@@ -47,121 +47,552 @@ along with uspr.  If not, see <http://www.gnu.org/licenses/>.
 #include <time.h>
 
 #include "utree.h"
+#include "fingerprint.h"
+#include "thread_pool.h"
 
 using namespace std;
 
+// CLASSES
+
+// view of one SPR neighbor given to a neighbor visitor
+// tree is the original tree with the SPR (x, y, w, z) applied and is only
+// valid during the visit; it is reverted afterwards. Its branching order is
+// normalized so it can be printed or encoded directly. uspr only repairs
+// the distances of the nodes it moves, so call normalize() before copying it
+class spr_neighbor {
+	public:
+	utree *tree;
+	unode *x;
+	unode *y;
+	unode *w;
+	unode *z;
+	tree_fingerprint fingerprint;
+
+	void normalize() const {
+		distances_from_leaf_decorator(*tree, tree->get_smallest_leaf());
+	}
+};
+
+// binary neighbor files
+// each input tree gives a block: a header, one fixed width record per
+// neighbor and an end record. Integers are 32 bit and fingerprints two
+// 64 bit words, all in native byte order.
+// header: the magic bytes "USPRNBR1", the record type, the number of
+// taxa, each taxon as its label, name length and name, then the size and
+// encoding of the original tree. Internal node labels are those of
+// utree(encoding, size).
+// MOVE_RECORDS: the move (x, y, w, z) applied to the original tree and
+// the neighbor's fingerprint. The end record has x == y == 0.
+// TREE_RECORDS: the neighbor's distance, fingerprint and encoding. The
+// end record has distance 0.
+enum neighbor_record_t {MOVE_RECORDS, TREE_RECORDS};
+const char NEIGHBOR_FILE_MAGIC[] = "USPRNBR1";
+
+class neighbor_record {
+	public:
+	int x;
+	int y;
+	int w;
+	int z;
+	int distance;
+	tree_fingerprint fingerprint;
+	vector<int> encoding;
+};
+
+// reads the blocks written by append_neighbor_header and the
+// append_*_record functions
+class neighbor_reader {
+	private:
+	istream &in;
+
+	template <typename T>
+	bool read_value(T &value) {
+		in.read((char *)&value, sizeof(T));
+		return (bool)in;
+	}
+
+	public:
+	neighbor_record_t record_type;
+	map<int, string> taxa;
+	vector<int> original;
+
+	neighbor_reader(istream &input) : in(input) {
+		record_type = MOVE_RECORDS;
+	}
+
+	// read the next block header, false at the end of the input
+	bool read_header() {
+		char magic[8];
+		if (!in.read(magic, 8) || memcmp(magic, NEIGHBOR_FILE_MAGIC, 8) != 0) {
+			return false;
+		}
+		int type;
+		int num_taxa;
+		read_value(type);
+		record_type = (neighbor_record_t)type;
+		read_value(num_taxa);
+		taxa.clear();
+		for (int i = 0; i < num_taxa; i++) {
+			int label;
+			int length;
+			read_value(label);
+			read_value(length);
+			string name = string(length, ' ');
+			in.read(&name[0], length);
+			taxa.insert(make_pair(label, name));
+		}
+		int tree_size;
+		read_value(tree_size);
+		original = vector<int>(tree_size);
+		in.read((char *)&original[0], tree_size * sizeof(int));
+		return (bool)in;
+	}
+
+	// read the next record of the block, false at its end record
+	bool read_record(neighbor_record &r) {
+		if (record_type == MOVE_RECORDS) {
+			read_value(r.x);
+			read_value(r.y);
+			read_value(r.w);
+			read_value(r.z);
+			r.distance = 1;
+		}
+		else {
+			read_value(r.distance);
+		}
+		read_value(r.fingerprint.high);
+		read_value(r.fingerprint.low);
+		if (record_type == TREE_RECORDS) {
+			r.encoding.resize(original.size());
+			in.read((char *)&r.encoding[0], original.size() * sizeof(int));
+		}
+		if (!in) {
+			return false;
+		}
+		if (record_type == MOVE_RECORDS) {
+			return r.x != r.y;
+		}
+		return r.distance != 0;
+	}
+
+	// the normalized neighbor tree of a record
+	utree tree(const neighbor_record &r) const {
+		if (record_type == TREE_RECORDS) {
+			return utree(&r.encoding[0], r.encoding.size());
+		}
+		utree T = utree(&original[0], original.size());
+		T.track_fingerprint();
+		T.uspr(T.get_node(r.x), T.get_node(r.y), T.get_node(r.w), T.get_node(r.z));
+		distances_from_leaf_decorator(T, T.get_smallest_leaf());
+		return T;
+	}
+};
+
 // FUNCTIONS
 
-list<utree> get_neighbors(utree *T, set<string> *known_trees = NULL);
-void get_neighbors(utree *T, unode *prev, unode *current, list<utree> &neighbors, set<string> *known_trees = NULL);
-void get_neighbors(utree *T, unode *x, unode *y, unode *prev, unode *current, list<utree> &neighbors, set<string> *known_trees = NULL);
-void add_neighbor(utree *T, unode *x, unode *y, unode *w, unode *z, list<utree> &neighbors, set<string> *known_trees = NULL);
+template <typename V>
+void visit_neighbors(utree *T, V visitor);
+template <typename V>
+void visit_neighbors(utree *T, unode *prev, unode *current, V &visitor);
+template <typename V>
+void visit_neighbors(utree *T, unode *x, unode *y, unode *prev, unode *current, V &visitor);
+template <typename V>
+void visit_neighbor(utree *T, unode *x, unode *y, unode *w, unode *z, V &visitor);
+template <typename V>
+void visit_neighbors_parallel(utree *T, thread_pool &pool, V visitor);
+void find_pruned_edges(unode *prev, unode *current, vector<pair<unode *, unode *> > &edges);
+template <typename V>
+void visit_neighborhood(utree *T, int radius, V visitor, bool keep_last_level = true);
+list<utree> get_neighbors(utree *T, fingerprint_set *known_trees = NULL);
+template <typename V>
+void visit_nni_neighbors(utree *T, V visitor);
+template <typename V>
+void visit_tbr_neighbors(utree *T, V visitor);
+void find_subtree_edges(unode *prev, unode *current, vector<pair<unode *, unode *> > &edges);
+long long num_taxa(utree *T);
+void append_neighbor_header(string &buffer, utree *T, map<int, string> *reverse_label_map, neighbor_record_t record_type);
+void append_move_record(string &buffer, const spr_neighbor &n);
+void append_tree_record(string &buffer, const spr_neighbor &n, int distance);
+void append_end_record(string &buffer, neighbor_record_t record_type, int tree_size);
+long long spr_neighborhood_size(utree *T);
+long long nni_neighborhood_size(utree *T);
 
 
-list<utree> get_neighbors(utree *T, set<string> *known_trees) {
-	list<utree> neighbors = list<utree>();
+// call visitor(const spr_neighbor &) for each SPR neighbor of T
+// each distinct neighbor is visited exactly once and nothing is copied
+// unless the visitor copies the tree
+template <typename V>
+void visit_neighbors(utree *T, V visitor) {
+	if (!T->is_fingerprint_tracked()) {
+		T->track_fingerprint();
+	}
 	unode *root = T->get_node(T->get_smallest_leaf());
-	get_neighbors(T, NULL, root, neighbors, known_trees);
-	return neighbors;
+	visit_neighbors(T, NULL, root, visitor);
 }
 
 // enumerate the source edges
-void get_neighbors(utree *T, unode *prev, unode *current, list<utree> &neighbors, set<string> *known_trees) {
+template <typename V>
+void visit_neighbors(utree *T, unode *prev, unode *current, V &visitor) {
 	// continue enumerating choices of the first edge
-	list<unode *> c_neighbors = current->get_neighbors();
+	neighbor_list c_neighbors = current->get_neighbors();
 	for (unode *next : c_neighbors) {
 		if (next != prev) {
-			get_neighbors(T, current, next, neighbors, known_trees);
+			visit_neighbors(T, current, next, visitor);
 		}
 	}
 	// try moving both sides of the edge (prev, current)
 	if (prev != NULL) {
-		get_neighbors(T, prev, current, prev, current, neighbors, known_trees);
-		get_neighbors(T, current, prev, current, prev, neighbors, known_trees);
+		visit_neighbors(T, prev, current, prev, current, visitor);
+		visit_neighbors(T, current, prev, current, prev, visitor);
 	}
 }
 
 // enumerate the target edges
-void get_neighbors(utree *T, unode *x, unode *y, unode *prev, unode *current, list<utree> &neighbors, set<string> *known_trees) {
+template <typename V>
+void visit_neighbors(utree *T, unode *x, unode *y, unode *prev, unode *current, V &visitor) {
 	// continue enumerating choices of the second edge
 	// copy the neighbor list as it may change
-	list<unode *> c_neighbors = current->get_neighbors();
+	neighbor_list c_neighbors = current->get_neighbors();
 	for (unode *next : c_neighbors) {
 		if (next != prev) {
-			get_neighbors(T, x, y, current, next, neighbors, known_trees);
+			visit_neighbors(T, x, y, current, next, visitor);
 		}
 	}
 	// test the spr move (T, x, y, prev, current)
 	if (prev != NULL) {
-		add_neighbor(T, x, y, prev, current, neighbors, known_trees);
+		visit_neighbor(T, x, y, prev, current, visitor);
 	}
 }
 
-void add_neighbor(utree *T, unode *x, unode *y, unode *w, unode *z, list<utree> &neighbors, set<string> *known_trees) {
-	// check for duplicate SPR moves
+template <typename V>
+void visit_neighbor(utree *T, unode *x, unode *y, unode *w, unode *z, V &visitor) {
+	// moves onto an edge adjacent to y do not change the tree
 	if (x == y ||
 			y == w ||
 			y == z ) {
 		return;
 	}
-	// TODO: other duplicates? probably NNIs, like with rooted SPR?
 
-	if (w == y->get_parent()->get_parent() &&
-			z == y->get_parent()) {
-		return;
+	// moves onto an edge adjacent to one of y's other neighbors are NNIs
+	// and each NNI tree is reachable by four such moves. Keep only the move
+	// that prunes the smaller labeled child of y and regrafts it next to
+	// y's parent. All other moves give distinct trees
+	unode *v = NULL;
+	if (y->is_adjacent(w)) {
+		v = w;
 	}
-	if (z == y->get_parent()->get_parent() &&
-			w == y->get_parent()) {
-		return;
+	else if (y->is_adjacent(z)) {
+		v = z;
 	}
-	if (z->get_parent() == y &&
-			w->get_parent() == z) {
-		return;
+	if (v != NULL) {
+		if (v != y->get_parent()) {
+			return;
+		}
+		unode *sibling = y->get_neighbor_not(x, v);
+		if (x->get_label() > sibling->get_label()) {
+			return;
+		}
 	}
-	if (w->get_parent() == y &&
-			z->get_parent() == w) {
-		return;
+
+	// apply the spr, repairing T along the path of the move
+	uspr_undo undo = uspr_undo();
+	T->uspr(x, y, w, z, undo);
+	spr_neighbor neighbor = spr_neighbor();
+	neighbor.tree = T;
+	neighbor.x = x;
+	neighbor.y = y;
+	neighbor.w = w;
+	neighbor.z = z;
+	// the fingerprint is updated by uspr and does not depend on branching
+	// order
+	neighbor.fingerprint = T->fingerprint();
+	visitor(neighbor);
+
+	// revert the SPR
+	T->undo_uspr(undo);
+	return;
+}
+
+// call visitor(const spr_neighbor &, int thread) for each SPR neighbor of T
+// using the threads of pool. The pruned edges are split between the
+// threads and each thread moves its own copy of T
+template <typename V>
+void visit_neighbors_parallel(utree *T, thread_pool &pool, V visitor) {
+	if (!T->is_fingerprint_tracked()) {
+		T->track_fingerprint();
 	}
+	unode *root = T->get_node(T->get_smallest_leaf());
+	vector<pair<unode *, unode *> > edges = vector<pair<unode *, unode *> >();
+	find_pruned_edges(NULL, root, edges);
+	vector<utree *> copies = vector<utree *>();
+	for (int i = 0; i < pool.size(); i++) {
+		copies.push_back(new utree(*T));
+	}
+	pool.parallel_for(edges.size(), [&](int i, int thread_id) {
+		utree *copy = copies[thread_id];
+		unode *x = copy->get_node(edges[i].first->get_label());
+		unode *y = copy->get_node(edges[i].second->get_label());
+		auto thread_visitor = [&](const spr_neighbor &n) {
+			visitor(n, thread_id);
+		};
+		visit_neighbors(copy, x, y, x, y, thread_visitor);
+	});
+	for (utree *copy : copies) {
+		delete copy;
+	}
+}
 
-	// node info so the uspr can be reversed
-	unode *yprime = NULL;
-	unode *y1 = NULL;
-	unode *y2 = NULL;
-	// apply the spr
-/*	cout << endl;
-	cout << "T: " << T->str(true) << endl;
-	cout << "\tx: " << x->get_label() << endl;
-	cout << "\ty: " << y->get_label() << endl;
-	cout << "\tw: " << w->get_label() << endl;
-	cout << "\tz: " << z->get_label() << endl;
-*/
-	T->uspr(x, y, w, z, &yprime, &y1, &y2);
-	// normalize the tree
-	distances_from_leaf_decorator(*T, T->get_smallest_leaf());
-	T->normalize_order();
-	// print the tree
-	//	cout << "neighbor: " << T->str() << endl;
-	string tree_string = T->str();
-	bool add_tree = true;
-	if (known_trees != NULL) {
-		if (known_trees->find(tree_string) == known_trees->end()) {
-			known_trees->insert(tree_string);
+// the pruned edges (x, y) in the order visit_neighbors tries them
+void find_pruned_edges(unode *prev, unode *current, vector<pair<unode *, unode *> > &edges) {
+	for (unode *next : current->get_neighbors()) {
+		if (next != prev) {
+			find_pruned_edges(current, next, edges);
 		}
-		else {
-			add_tree = false;
+	}
+	if (prev != NULL) {
+		edges.push_back(make_pair(prev, current));
+		edges.push_back(make_pair(current, prev));
+	}
+}
+
+// call visitor(const spr_neighbor &, int distance) once for each tree at
+// SPR distance 1 to radius from T, in order of distance. This is a
+// breadth first search that stores each level as back to back encodings
+// and rejects trees seen before by their fingerprints. Without
+// keep_last_level the trees at the last distance are only visited
+template <typename V>
+void visit_neighborhood(utree *T, int radius, V visitor, bool keep_last_level) {
+	fingerprint_set seen = fingerprint_set();
+	if (!T->is_fingerprint_tracked()) {
+		T->track_fingerprint();
+	}
+	seen.insert(T->fingerprint());
+	vector<int> level = vector<int>();
+	T->encode(level);
+	int tree_size = level.size();
+	for (int distance = 1; distance <= radius && !level.empty(); distance++) {
+		bool keep = keep_last_level || distance < radius;
+		vector<int> next_level = vector<int>();
+		for (size_t i = 0; i < level.size(); i += tree_size) {
+			utree current = utree(&level[i], tree_size);
+			visit_neighbors(&current, [&](const spr_neighbor &n) {
+				if (!seen.insert(n.fingerprint)) {
+					return;
+				}
+				visitor(n, distance);
+				if (keep) {
+					n.tree->encode(next_level);
+				}
+			});
 		}
+		level.swap(next_level);
 	}
-	if (add_tree) {
-		neighbors.push_back(utree(*T));
+}
+
+// copies of the SPR neighbors of T, skipping trees in known_trees
+// and adding the new trees to it
+list<utree> get_neighbors(utree *T, fingerprint_set *known_trees) {
+	list<utree> neighbors = list<utree>();
+	visit_neighbors(T, [&](const spr_neighbor &n) {
+		if (known_trees != NULL && !known_trees->insert(n.fingerprint)) {
+			return;
+		}
+		n.normalize();
+		neighbors.push_back(utree(*n.tree));
+	});
+	return neighbors;
+}
+
+// call visitor(const spr_neighbor &) for each NNI neighbor of T
+// these are the canonical NNI moves of visit_neighbor: for each internal
+// edge (y, v) with v the parent of y, move the smaller labeled child of y
+// next to each of v's other neighbors
+template <typename V>
+void visit_nni_neighbors(utree *T, V visitor) {
+	if (!T->is_fingerprint_tracked()) {
+		T->track_fingerprint();
+	}
+	for (unode *y : T->get_internal_nodes()) {
+		if (y == NULL || y->get_num_neighbors() != 3) {
+			continue;
+		}
+		unode *v = y->get_parent();
+		if (v->get_label() >= 0) {
+			continue;
+		}
+		unode *x = y->get_neighbor_not(v);
+		unode *sibling = y->get_neighbor_not(x, v);
+		if (sibling->get_label() < x->get_label()) {
+			x = sibling;
+		}
+		// copy the neighbor list as it may change
+		neighbor_list v_neighbors = v->get_neighbors();
+		for (unode *t : v_neighbors) {
+			if (t != y) {
+				visit_neighbor(T, x, y, v, t, visitor);
+			}
+		}
 	}
+}
 
+// call visitor(const spr_neighbor &) once for each TBR neighbor of T
+// a TBR move removes an edge (x, y) and reconnects the two sides through
+// an edge of each side. It is applied as an SPR that moves x to its new
+// edge on x's side, which is skipped if x keeps its place, followed by an
+// SPR that moves y's edge to x's side across to y's new edge. The same
+// tree has many TBR moves so they are deduplicated by fingerprint.
+// The view's move (x, y, w, z) is the second SPR
+template <typename V>
+void visit_tbr_neighbors(utree *T, V visitor) {
+	if (!T->is_fingerprint_tracked()) {
+		T->track_fingerprint();
+	}
+	fingerprint_set seen = fingerprint_set();
+	seen.insert(T->fingerprint());
+	unode *root = T->get_node(T->get_smallest_leaf());
+	vector<pair<unode *, unode *> > edges = vector<pair<unode *, unode *> >();
+	find_pruned_edges(NULL, root, edges);
+	spr_neighbor neighbor = spr_neighbor();
+	neighbor.tree = T;
+	// each edge appears in both directions
+	for (size_t i = 0; i < edges.size(); i += 2) {
+		unode *x = edges[i].first;
+		unode *y = edges[i].second;
+		// the edges not adjacent to x and y on their sides
+		vector<pair<unode *, unode *> > x_edges = vector<pair<unode *, unode *> >();
+		vector<pair<unode *, unode *> > y_edges = vector<pair<unode *, unode *> >();
+		for (unode *n : x->get_neighbors()) {
+			if (n != y) {
+				find_subtree_edges(x, n, x_edges);
+			}
+		}
+		for (unode *n : y->get_neighbors()) {
+			if (n != x) {
+				find_subtree_edges(y, n, y_edges);
+			}
+		}
+		for (int j = -1; j < (int)x_edges.size(); j++) {
+			uspr_undo x_undo = uspr_undo();
+			if (j >= 0) {
+				T->uspr(y, x, x_edges[j].first, x_edges[j].second, x_undo);
+			}
+			for (int k = -1; k < (int)y_edges.size(); k++) {
+				uspr_undo y_undo = uspr_undo();
+				if (k >= 0) {
+					T->uspr(x, y, y_edges[k].first, y_edges[k].second, y_undo);
+				}
+				if (seen.insert(T->fingerprint())) {
+					neighbor.x = x;
+					neighbor.y = y;
+					neighbor.w = (k >= 0) ? y_edges[k].first : NULL;
+					neighbor.z = (k >= 0) ? y_edges[k].second : NULL;
+					neighbor.fingerprint = T->fingerprint();
+					visitor(neighbor);
+				}
+				if (k >= 0) {
+					T->undo_uspr(y_undo);
+				}
+			}
+			if (j >= 0) {
+				T->undo_uspr(x_undo);
+			}
+		}
+	}
+}
 
-	// revert the SPR
-	T->uspr(x, yprime, y1, y2);
-	distances_from_leaf_decorator(*T, T->get_smallest_leaf());
-	T->normalize_order();
-//	cout << "T: " << T->str() << endl;
-//	cout << endl;
-	return;
+// the edges below current, away from prev, that are not adjacent to current
+void find_subtree_edges(unode *prev, unode *current, vector<pair<unode *, unode *> > &edges) {
+	for (unode *next : current->get_neighbors()) {
+		if (next != prev) {
+			edges.push_back(make_pair(current, next));
+			find_subtree_edges(current, next, edges);
+		}
+	}
+}
+
+template <typename T>
+void append_value(string &buffer, const T &value) {
+	buffer.append((const char *)&value, sizeof(T));
+}
+
+// start a binary block for the neighbors of T
+// T's internal labels must match utree(encoding, size), so T should be
+// built from its own encoding when move records are written
+void append_neighbor_header(string &buffer, utree *T, map<int, string> *reverse_label_map, neighbor_record_t record_type) {
+	buffer.append(NEIGHBOR_FILE_MAGIC, 8);
+	append_value(buffer, (int)record_type);
+	int num_taxa = 0;
+	if (reverse_label_map != NULL) {
+		num_taxa = reverse_label_map->size();
+	}
+	append_value(buffer, num_taxa);
+	if (reverse_label_map != NULL) {
+		for (const pair<const int, string> &taxon : *reverse_label_map) {
+			append_value(buffer, taxon.first);
+			append_value(buffer, (int)taxon.second.size());
+			buffer += taxon.second;
+		}
+	}
+	vector<int> encoding = vector<int>();
+	T->encode(encoding);
+	append_value(buffer, (int)encoding.size());
+	buffer.append((const char *)&encoding[0], encoding.size() * sizeof(int));
+}
+
+void append_move_record(string &buffer, const spr_neighbor &n) {
+	append_value(buffer, n.x->get_label());
+	append_value(buffer, n.y->get_label());
+	append_value(buffer, n.w->get_label());
+	append_value(buffer, n.z->get_label());
+	append_value(buffer, n.fingerprint.high);
+	append_value(buffer, n.fingerprint.low);
+}
+
+void append_tree_record(string &buffer, const spr_neighbor &n, int distance) {
+	append_value(buffer, distance);
+	append_value(buffer, n.fingerprint.high);
+	append_value(buffer, n.fingerprint.low);
+	vector<int> encoding = vector<int>();
+	n.tree->encode(encoding);
+	buffer.append((const char *)&encoding[0], encoding.size() * sizeof(int));
+}
+
+void append_end_record(string &buffer, neighbor_record_t record_type, int tree_size) {
+	int size = 4 * sizeof(int) + 2 * sizeof(uint64_t);
+	if (record_type == TREE_RECORDS) {
+		size = sizeof(int) + 2 * sizeof(uint64_t) + tree_size * sizeof(int);
+	}
+	buffer.append(size, '\0');
+}
+
+// number of leaves of T
+long long num_taxa(utree *T) {
+	long long n = 0;
+	for (unode *leaf : T->get_leaves()) {
+		if (leaf != NULL) {
+			n++;
+		}
+	}
+	return n;
+}
+
+// number of SPR neighbors of T, computed without enumerating them
+// an unrooted binary tree with n leaves has 2(n-3)(2n-7) SPR neighbors
+// regardless of its shape (Allen and Steel 2001)
+long long spr_neighborhood_size(utree *T) {
+	long long n = num_taxa(T);
+	if (n < 4) {
+		return 0;
+	}
+	return 2 * (n - 3) * (2 * n - 7);
+}
+
+// number of NNI neighbors of T, two for each of its n-3 internal edges
+long long nni_neighborhood_size(utree *T) {
+	long long n = num_taxa(T);
+	if (n < 4) {
+		return 0;
+	}
+	return 2 * (n - 3);
 }
 #endif
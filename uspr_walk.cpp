@@ -0,0 +1,202 @@
+/*******************************************************************************
+uspr_walk.cpp
+
+Usage: uspr_walk [OPTIONS]
+Generate pairs of unrooted binary trees that are a given number of random SPR
+moves apart. Starting trees are read from standard input in newick format or
+generated at random. See the README for more information.
+
+Copyright 2018 Chris Whidden
+cwhidden@fredhutch.org
+https://github.com/cwhidden/uspr
+May 1, 2018
+Version 1.0.1
+
+This file is part of uspr.
+
+uspr is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+uspr is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with uspr.  If not, see <http://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+// includes
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <cstdlib>
+#include "utree.h"
+#include "unode.h"
+#include "uforest.h"
+#include "uspr_walk.h"
+
+using namespace std;
+
+// constants
+//
+int MOVES = 1;
+long PAIRS = 1;
+int RANDOM_TAXA = 0;
+unsigned int SEED = unsigned(time(0));
+// bytes of output buffered before writing
+const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+
+string USAGE =
+"uspr_walk, version 1.0.1\n"
+"\n"
+"usage: uspr_walk [OPTIONS]\n"
+"Generate pairs of unrooted binary trees that are a given number of random SPR\n"
+"moves apart. Each pair is printed as two lines so the output can be passed to\n"
+"uspr. Input starting trees in newick format on STDIN, one per line, or use\n"
+"--random\n"
+"\n"
+"Copyright 2018 Chris Whidden\n"
+"cwhidden@fredhutch.org\n"
+"https://github.com/cwhidden/uspr\n"
+"May 1, 2018\n"
+"Version 1.0.1\n"
+"\n"
+"This program comes with ABSOLUTELY NO WARRANTY.\n"
+"This is free software, and you are welcome to redistribute it\n"
+"under certain conditions; See the README for details.\n"
+"\n"
+"Basic options\n"
+"\n"
+"-h --help              Print program information and exit.\n"
+"\n"
+"--moves k              Apply k uniformly random SPR moves to get the second\n"
+"                       tree of each pair. The trees are at most k SPR moves\n"
+"                       apart. Default 1.\n"
+"\n"
+"--pairs p              Generate p pairs from each starting tree. Default 1.\n"
+"\n"
+"--random n             Do not read STDIN and instead start each of the p pairs\n"
+"                       from a new uniformly random tree with n leaves.\n"
+"\n"
+"--seed s               Seed the random number generator with s for\n"
+"                       reproducible output. Defaults to the time.\n";
+
+// function prototypes
+void walk_pairs(uforest &start, map<int, string> &reverse_label_map, mt19937 &generator, string &buffer);
+
+
+int main(int argc, char *argv[]) {
+	int max_args = argc-1;
+	while (argc > 1) {
+		char *arg = argv[--argc];
+		if (strcmp(arg, "--moves") == 0) {
+			if (max_args > argc) {
+				char *arg2 = argv[argc+1];
+				if (arg2[0] != '-') {
+					MOVES = atoi(arg2);
+				}
+			}
+		}
+		else if (strcmp(arg, "--pairs") == 0) {
+			if (max_args > argc) {
+				char *arg2 = argv[argc+1];
+				if (arg2[0] != '-') {
+					PAIRS = atol(arg2);
+				}
+			}
+		}
+		else if (strcmp(arg, "--random") == 0) {
+			if (max_args > argc) {
+				char *arg2 = argv[argc+1];
+				if (arg2[0] != '-') {
+					RANDOM_TAXA = atoi(arg2);
+				}
+			}
+		}
+		else if (strcmp(arg, "--seed") == 0) {
+			if (max_args > argc) {
+				char *arg2 = argv[argc+1];
+				if (arg2[0] != '-') {
+					SEED = strtoul(arg2, NULL, 10);
+				}
+			}
+		}
+		else if (strcmp(arg, "--help") == 0 ||
+				strcmp(arg, "-h") == 0 ||
+				strcmp(arg, "-help") == 0) {
+			cout << USAGE;
+			return 0;
+		}
+	}
+
+	// set random seed
+	mt19937 generator = mt19937(SEED);
+
+	string buffer = string();
+	if (RANDOM_TAXA > 0) {
+		if (RANDOM_TAXA < 4) {
+			cerr << "--random requires at least 4 leaves" << endl;
+			return 1;
+		}
+		long pairs = PAIRS;
+		PAIRS = 1;
+		for (long i = 0; i < pairs; i++) {
+			map<string, int> label_map = map<string, int>();
+			map<int, string> reverse_label_map = map<int, string>();
+			string T_line = random_tree(RANDOM_TAXA, generator);
+			uforest T = uforest(T_line, &label_map, &reverse_label_map);
+			walk_pairs(T, reverse_label_map, generator, buffer);
+		}
+	}
+	else {
+		// label maps to allow string labels
+		map<string, int> label_map = map<string, int>();
+		map<int, string> reverse_label_map = map<int, string>();
+
+		// read input trees
+		string T_line = "";
+		while (getline(cin, T_line)) {
+			uforest T = uforest(T_line, &label_map, &reverse_label_map);
+			if (T.num_leaves() < 4) {
+				cerr << "skipping a tree with fewer than 4 leaves" << endl;
+				continue;
+			}
+			walk_pairs(T, reverse_label_map, generator, buffer);
+		}
+	}
+	cout << buffer;
+	cout.flush();
+}
+
+// print PAIRS pairs of T and a random walk of MOVES SPR moves from it
+// each walk is undone to start the next one rather than copying T
+void walk_pairs(uforest &T, map<int, string> &reverse_label_map, mt19937 &generator, string &buffer) {
+	T.normalize_order();
+	string start_str = T.str(false, &reverse_label_map);
+	spr_walk walk(&T, generator);
+	vector<uspr_undo> moves = vector<uspr_undo>(MOVES);
+	for (long i = 0; i < PAIRS; i++) {
+		for (int j = 0; j < MOVES; j++) {
+			walk.step(moves[j]);
+		}
+		T.normalize_order();
+		buffer += start_str;
+		buffer += '\n';
+		buffer += T.str(false, &reverse_label_map);
+		buffer += '\n';
+		if (buffer.size() >= OUTPUT_BUFFER_SIZE) {
+			cout << buffer;
+			buffer.clear();
+		}
+		for (int j = MOVES - 1; j >= 0; j--) {
+			walk.undo_step(moves[j]);
+		}
+	}
+}
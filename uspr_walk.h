@@ -0,0 +1,426 @@
+/*******************************************************************************
+uspr_walk.h
+
+Random SPR walks on unrooted trees
+
+Copyright 2018 Chris Whidden
+cwhidden@fredhutch.org
+https://github.com/cwhidden/uspr
+May 1, 2018
+Version 1.0.1
+
+This file is part of uspr.
+
+uspr is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+uspr is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with uspr.  If not, see <http://www.gnu.org/licenses/>.
+*******************************************************************************/
+
+
+#ifndef INCLUDE_USPR_WALK
+#define INCLUDE_USPR_WALK
+
+// INCLUDES
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <utility>
+#include <random>
+#include <cstdint>
+
+#include "utree.h"
+
+using namespace std;
+
+int random_index(int n, mt19937 &generator);
+
+// CLASSES
+
+// one directed edge (from, to) of an Euler tour, stored in a treap
+// ordered by tour position
+class tour_edge {
+	public:
+	int from;
+	int to;
+	uint32_t priority;
+	int size;
+	tour_edge *left;
+	tour_edge *right;
+	tour_edge *parent;
+
+	tour_edge() {
+		from = -1;
+		to = -1;
+		priority = 0;
+		size = 1;
+		left = NULL;
+		right = NULL;
+		parent = NULL;
+	}
+};
+
+// a random walk of SPR moves on a utree
+// The tree's cyclic Euler tour is kept in a treap so the side of an edge
+// that a node lies on is found in O(log n). A uniformly random valid move
+// is then sampled by rejection in O(1) expected tries, without
+// enumerating the neighborhood, and applied to the tour in O(log n) and
+// to the tree with utree::uspr. Moves are uniform over the valid
+// (x, y, (w, z)) triples, so an NNI neighbor, which four moves reach, is
+// four times as likely as any other SPR neighbor
+class spr_walk {
+	private:
+	utree *T;
+	int num_leaves;
+	// three slots of directed edges leaving each node
+	vector<tour_edge> slots;
+	// the used slots, to sample an edge uniformly
+	vector<tour_edge *> edges;
+	tour_edge *root;
+	mt19937 &generator;
+
+	public:
+	spr_walk(utree *tree, mt19937 &random_generator) : generator(random_generator) {
+		T = tree;
+		num_leaves = T->num_leaves();
+		int num_nodes = num_leaves + T->get_internal_nodes().size();
+		slots = vector<tour_edge>(3 * num_nodes);
+		edges = vector<tour_edge *>();
+		root = NULL;
+		unode *r = T->get_node(T->get_smallest_leaf());
+		build_tour(r->get_neighbors().front(), r);
+	}
+
+	// the treap points into slots
+	spr_walk(const spr_walk &) = delete;
+
+	// apply a uniformly random SPR move
+	void step() {
+		uspr_undo undo;
+		step(undo);
+	}
+
+	// apply a uniformly random SPR move and record how to revert it
+	void step(uspr_undo &undo) {
+		tour_edge *f;
+		tour_edge *t;
+		sample_move(f, t);
+		T->uspr(T->get_node(f->from), T->get_node(f->to),
+				T->get_node(t->from), T->get_node(t->to), undo);
+		apply_move(f, t);
+	}
+
+	// revert the last step
+	void undo_step(const uspr_undo &undo) {
+		int x = undo.x->get_label();
+		int y = undo.y->get_label();
+		T->undo_uspr(undo);
+		apply_move(find_edge(x, y), find_edge(undo.y1->get_label(), undo.y2->get_label()));
+	}
+
+	// the directed edges of the tour in order
+	void tour(vector<pair<int, int> > &sequence) {
+		tour_hlpr(root, sequence);
+	}
+
+	private:
+	int index(int label) {
+		if (label < 0) {
+			return num_leaves - label - 2;
+		}
+		return label;
+	}
+
+	tour_edge *find_edge(int from, int to) {
+		tour_edge *e = &slots[3 * index(from)];
+		while (e->to != to) {
+			e++;
+		}
+		return e;
+	}
+
+	bool is_leaf(int label) {
+		return label >= 0;
+	}
+
+	// append the tour of the subtree entered by the edge (prev, n)
+	void build_tour(unode *n, unode *prev) {
+		append_edge(prev->get_label(), n->get_label());
+		for (unode *c : n->get_neighbors()) {
+			if (c != prev) {
+				build_tour(c, n);
+			}
+		}
+		append_edge(n->get_label(), prev->get_label());
+	}
+
+	void append_edge(int from, int to) {
+		tour_edge *e = &slots[3 * index(from)];
+		while (e->from != -1) {
+			e++;
+		}
+		e->from = from;
+		e->to = to;
+		e->priority = generator();
+		edges.push_back(e);
+		root = merge(root, e);
+	}
+
+	// pick the pruned edge (x, y) and target edge (w, z) uniformly, then
+	// reject the pair unless (w, z) is on y's side of (x, y) and not
+	// adjacent to y. About 3/8 of the pairs are accepted
+	void sample_move(tour_edge *&f, tour_edge *&t) {
+		while (true) {
+			f = edges[random_index(edges.size(), generator)];
+			if (is_leaf(f->to)) {
+				continue;
+			}
+			t = edges[random_index(edges.size(), generator)];
+			if (t->from == f->to || t->to == f->to) {
+				continue;
+			}
+			// y's side is the part of the tour after (x, y) and before (y, x)
+			int start = position(f);
+			int end = position(find_edge(f->to, f->from));
+			int p = position(t);
+			if (start < end ? (start < p && p < end) : (p > start || p < end)) {
+				return;
+			}
+		}
+	}
+
+	// prune the subtree entered by (y, x), join y's other neighbors a and b
+	// and regraft onto (w, z). In tour order
+	// (y,x) X (x,y) (y,a) A (a,y) (y,b) B (b,y)
+	// becomes (w,y) (y,x) X (x,y) (y,z) Z (z,y) (y,w) W
+	// with A (a,b) B (b,a) = (w,z) Z (z,w) W. Only the targets change so
+	// every edge keeps its slot
+	void apply_move(tour_edge *f, tour_edge *t) {
+		int x = f->from;
+		int y = f->to;
+		int w = t->from;
+		int z = t->to;
+		tour_edge *t_back = find_edge(z, w);
+
+		// start the tour at (y, x)
+		tour_edge *a;
+		tour_edge *b;
+		rotate_to(find_edge(y, x));
+		split(root, position(f) + 1, a, b);
+		tour_edge *pruned = a;
+		tour_edge *rest = b;
+
+		// remove y
+		tour_edge *y_a;
+		tour_edge *y_b;
+		split(rest, 1, y_a, rest);
+		tour_edge *a_y = find_edge(y_a->to, y);
+		split(rest, position(a_y) + 1, a, b);
+		split(b, 1, y_b, b);
+		tour_edge *b_y = find_edge(y_b->to, y);
+		a_y->to = y_b->to;
+		b_y->to = y_a->to;
+		root = merge(a, b);
+
+		// regraft
+		rotate_to(t);
+		tour_edge *z_side;
+		tour_edge *w_side;
+		split(root, 1, a, rest);
+		split(rest, position(t_back), z_side, rest);
+		split(rest, 1, b, w_side);
+		t->to = y;
+		t_back->to = y;
+		y_a->to = z;
+		y_b->to = w;
+		root = merge(merge(merge(t, pruned), merge(y_a, z_side)),
+				merge(merge(t_back, y_b), w_side));
+	}
+
+	// treap operations
+
+	int size(tour_edge *e) {
+		if (e == NULL) {
+			return 0;
+		}
+		return e->size;
+	}
+
+	void update(tour_edge *e) {
+		e->size = 1 + size(e->left) + size(e->right);
+		if (e->left != NULL) {
+			e->left->parent = e;
+		}
+		if (e->right != NULL) {
+			e->right->parent = e;
+		}
+	}
+
+	tour_edge *merge(tour_edge *a, tour_edge *b) {
+		if (a == NULL) {
+			if (b != NULL) {
+				b->parent = NULL;
+			}
+			return b;
+		}
+		if (b == NULL) {
+			a->parent = NULL;
+			return a;
+		}
+		if (a->priority > b->priority) {
+			a->right = merge(a->right, b);
+			update(a);
+			a->parent = NULL;
+			return a;
+		}
+		else {
+			b->left = merge(a, b->left);
+			update(b);
+			b->parent = NULL;
+			return b;
+		}
+	}
+
+	// split e into its first k edges and the rest
+	void split(tour_edge *e, int k, tour_edge *&a, tour_edge *&b) {
+		if (e == NULL) {
+			a = NULL;
+			b = NULL;
+			return;
+		}
+		if (size(e->left) < k) {
+			split(e->right, k - size(e->left) - 1, e->right, b);
+			update(e);
+			a = e;
+		}
+		else {
+			split(e->left, k, a, e->left);
+			update(e);
+			b = e;
+		}
+		if (a != NULL) {
+			a->parent = NULL;
+		}
+		if (b != NULL) {
+			b->parent = NULL;
+		}
+	}
+
+	// position of e in its treap
+	int position(tour_edge *e) {
+		int p = size(e->left);
+		while (e->parent != NULL) {
+			if (e->parent->right == e) {
+				p += size(e->parent->left) + 1;
+			}
+			e = e->parent;
+		}
+		return p;
+	}
+
+	// rotate the tour so that it starts with e
+	void rotate_to(tour_edge *e) {
+		tour_edge *a;
+		tour_edge *b;
+		split(root, position(e), a, b);
+		root = merge(b, a);
+	}
+
+	void tour_hlpr(tour_edge *e, vector<pair<int, int> > &sequence) {
+		if (e == NULL) {
+			return;
+		}
+		tour_hlpr(e->left, sequence);
+		sequence.push_back(make_pair(e->from, e->to));
+		tour_hlpr(e->right, sequence);
+	}
+};
+
+// FUNCTIONS
+
+int random_index(int n, mt19937 &generator);
+string random_tree(int n, mt19937 &generator);
+void random_tree_hlpr(string &s, vector<vector<int> > &neighbors, int n, int prev);
+
+// a random integer in [0, n)
+// mt19937 output is fixed by the standard, unlike rand() and
+// uniform_int_distribution, so a seed gives the same walks everywhere
+int random_index(int n, mt19937 &generator) {
+	return (int)(((uint64_t)generator() * n) >> 32);
+}
+
+// a uniformly random unrooted binary topology on the leaves 0..n-1 in
+// newick format, built by adding each leaf to a random edge
+string random_tree(int n, mt19937 &generator) {
+	vector<vector<int> > neighbors = vector<vector<int> >(2 * n - 2);
+	vector<pair<int, int> > edges = vector<pair<int, int> >();
+	// the three leaf star
+	for (int i = 0; i < 3 && i < n; i++) {
+		neighbors[i].push_back(n);
+		neighbors[n].push_back(i);
+		edges.push_back(make_pair(i, n));
+	}
+	for (int i = 3; i < n; i++) {
+		int m = n + i - 2;
+		int e = random_index(edges.size(), generator);
+		int u = edges[e].first;
+		int v = edges[e].second;
+		for (int &k : neighbors[u]) {
+			if (k == v) {
+				k = m;
+			}
+		}
+		for (int &k : neighbors[v]) {
+			if (k == u) {
+				k = m;
+			}
+		}
+		neighbors[m].push_back(u);
+		neighbors[m].push_back(v);
+		neighbors[m].push_back(i);
+		neighbors[i].push_back(m);
+		edges[e].second = m;
+		edges.push_back(make_pair(m, v));
+		edges.push_back(make_pair(m, i));
+	}
+	int root = neighbors[0].front();
+	string s = "(0";
+	for (int c : neighbors[root]) {
+		if (c != 0) {
+			s += ",";
+			random_tree_hlpr(s, neighbors, c, root);
+		}
+	}
+	s += ")";
+	return s;
+}
+
+void random_tree_hlpr(string &s, vector<vector<int> > &neighbors, int n, int prev) {
+	if (neighbors[n].size() == 1) {
+		s += to_string(n);
+		return;
+	}
+	s += "(";
+	bool first = true;
+	for (int c : neighbors[n]) {
+		if (c != prev) {
+			if (!first) {
+				s += ",";
+			}
+			random_tree_hlpr(s, neighbors, c, n);
+			first = false;
+		}
+	}
+	s += ")";
+}
+
+#endif
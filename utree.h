@@ -31,107 +31,164 @@ along with uspr.  If not, see <http://www.gnu.org/licenses/>.
 #include <vector>
 #include <iostream>
 #include "unode.h"
+#include "fingerprint.h"
 
 using namespace std;
 
 class utree;
+class uspr_undo;
 
 // options
 bool KEEP_LABELS = false;
 
 // prototypes
 bool build_utree(utree &t, string &s, map<string, int> *label_map = NULL, map<int, string> *reverse_label_map = NULL);
+void build_utree(utree &t, const int *encoding, int size);
 int build_utree_helper(utree &t, string &s, int start, unode *parent, bool &valid, map<string, int> *label_map = NULL, map<int, string> *reverse_label_map = NULL);
 void find_sibling_pairs_hlpr(utree &t, map<int, int> &sibling_pairs);
 map<int, int> distances_from_leaf(utree &T1, int leaf);
 void distances_from_leaf_hlpr(utree &T1, map<int, int> &distances, unode *prev, unode *current, int distance);
 void distances_from_leaf_decorator(utree &T1, int leaf);
 void distances_from_leaf_decorator_hlpr(utree &T1, unode *prev, unode *current, int distance);
+tree_fingerprint fingerprint_hlpr(unode *prev, unode *current, tree_fingerprint &f, bool track = false);
+
+// the nodes needed to revert a uspr
+class uspr_undo {
+	public:
+	unode *x;
+	unode *y;
+	unode *y1;
+	unode *y2;
+};
+
+// contiguous storage for the nodes of a tree
+// nodes are kept in blocks that are never grown past their capacity, so
+// node pointers stay valid as nodes are added. A copied tree keeps all of
+// its nodes in one block. Blocks for trees built a node at a time are
+// kept under 1KB as glibc consolidates its small free lists on every
+// larger request.
+// Nodes are still unode objects linked by pointer rather than arrays of
+// 32-bit indices, since tbr.h and uforest walk and change forests through
+// unode pointers throughout. Profiling the TBR and replug distances on
+// 40-leaf trees, the node walks take under 10% of the time and forest
+// copies a quarter to a third of it, so copies are made cheaper instead
+class unode_storage {
+	private:
+	static const size_t BLOCK_SIZE = 8;
+	vector<vector<unode> > blocks;
+	size_t num_nodes;
+
+	public:
+	unode_storage() {
+		blocks = vector<vector<unode> >();
+		num_nodes = 0;
+	}
+
+	// make room for n more nodes in the current block
+	void reserve(size_t n) {
+		if (!blocks.empty() && blocks.back().empty()) {
+			blocks.back().reserve(n);
+		}
+		else if (blocks.empty() ||
+				blocks.back().capacity() - blocks.back().size() < n) {
+			blocks.push_back(vector<unode>());
+			blocks.back().reserve(n);
+		}
+	}
+
+	// remove the nodes, keeping the first block for reuse
+	void clear() {
+		if (blocks.size() > 1) {
+			blocks.resize(1);
+		}
+		if (!blocks.empty()) {
+			blocks.back().clear();
+		}
+		num_nodes = 0;
+	}
+
+	unode *add(int label) {
+		make_room();
+		blocks.back().emplace_back(label);
+		num_nodes++;
+		return &blocks.back().back();
+	}
+
+	// copy n, including its neighbors
+	unode *add(const unode &n) {
+		make_room();
+		blocks.back().emplace_back(n);
+		num_nodes++;
+		return &blocks.back().back();
+	}
+
+	size_t size() const {
+		return num_nodes;
+	}
+
+	friend void swap(unode_storage &first, unode_storage &second) {
+		swap(first.blocks, second.blocks);
+		swap(first.num_nodes, second.num_nodes);
+	}
+
+	private:
+	void make_room() {
+		if (blocks.empty() ||
+				blocks.back().size() == blocks.back().capacity()) {
+			blocks.push_back(vector<unode>());
+			blocks.back().reserve(BLOCK_SIZE);
+		}
+	}
+};
 
 class utree {
 	protected:
+		// pointers into node_storage by label
 		vector <unode*> internal_nodes;
 		vector <unode*> leaves;
+		unode_storage node_storage;
 		int smallest_leaf;
+		// fingerprint maintained by uspr, see track_fingerprint()
+		tree_fingerprint tracked_fingerprint;
+		bool fingerprint_tracked;
 	public:
 		// create the tree
 		utree(string &newick, map<string, int> *label_map = NULL, map<int, string> *reverse_label_map = NULL) {
 			internal_nodes = vector<unode *>();
 			leaves = vector<unode *>();
+			fingerprint_tracked = false;
 			build_utree(*this, newick, label_map, reverse_label_map);
 		}
+		// create the tree from an encoding produced by encode()
+		utree(const int *encoding, int size) {
+			internal_nodes = vector<unode *>();
+			leaves = vector<unode *>();
+			fingerprint_tracked = false;
+			build_utree(*this, encoding, size);
+		}
 		utree(const utree &T) {
-			// copy vectors of pointers
-			int internal_nodes_size = T.internal_nodes.size();
-			int leaves_size = T.leaves.size();
-			internal_nodes = vector<unode *>(internal_nodes_size);
-			leaves = vector<unode *>(leaves_size);
-			smallest_leaf = T.smallest_leaf;
-			// create new nodes
-			for(int i = 0; i < internal_nodes_size; i++) {
-				if (T.internal_nodes[i] != NULL) {
-					internal_nodes[i] = new unode(*(T.internal_nodes[i]), false);
-				}
-			}
-			for(int i = 0; i < leaves_size; i++) {
-				if (T.leaves[i] != NULL) {
-					leaves[i] = new unode(*(T.leaves[i]), false);
-				}
-			}
-			// update neighbor pointers
-			for(int i = 0; i < internal_nodes_size; i++) {
-				if (internal_nodes[i] != NULL) {
-					list<unode *> &old_neighbors = T.internal_nodes[i]->get_neighbors();
-					for (unode *u : old_neighbors) {
-						internal_nodes[i]->add_neighbor(get_node(u->get_label()));
-					}
-					list<unode *> &old_contracted_neighbors = T.internal_nodes[i]->get_contracted_neighbors();
-					for (unode *u : old_contracted_neighbors) {
-						internal_nodes[i]->add_contracted_neighbor(get_node(u->get_label()));
-					}
-				}
-			}
-			for(int i = 0; i < leaves_size; i++) {
-				if (leaves[i] != NULL) {
-					list<unode *> &old_neighbors = T.leaves[i]->get_neighbors();
-					for (unode *u : old_neighbors) {
-						leaves[i]->add_neighbor(get_node(u->get_label()));
-					}
-					list<unode *> &old_contracted_neighbors = T.leaves[i]->get_contracted_neighbors();
-					for (unode *u : old_contracted_neighbors) {
-						leaves[i]->add_contracted_neighbor(get_node(u->get_label()));
-					}
-				}
-			}
+			copy_nodes(T);
 		}
-		~utree() {
-			int end = internal_nodes.size();
-			for(int i = 0; i < end; i++) {
-				if (internal_nodes[i] != NULL) {
-					delete internal_nodes[i];
-				}
-			}
-			end = leaves.size();
-			for(int i = 0; i < end; i++) {
-				if (leaves[i] != NULL) {
-					delete leaves[i];
-				}
+		// reuses this tree's memory, unlike copy construction
+		utree& operator=(const utree &T) {
+			if (this != &T) {
+				copy_nodes(T);
 			}
-		}
-		utree& operator=(utree T) {
-			swap(*this, T);
 			return *this;
 		}
 		friend void swap(utree &first, utree &second) {
 			swap(first.internal_nodes, second.internal_nodes);
 			swap(first.leaves, second.leaves);
+			swap(first.node_storage, second.node_storage);
 			swap(first.smallest_leaf, second.smallest_leaf);
+			swap(first.tracked_fingerprint, second.tracked_fingerprint);
+			swap(first.fingerprint_tracked, second.fingerprint_tracked);
 		}
 	friend ostream& operator<<(ostream &os, const utree& t);
 
 	 int add_internal_node() {
 		int label = -(internal_nodes.size() + 2);
-		internal_nodes.push_back( new unode(label));
+		internal_nodes.push_back(node_storage.add(label));
 		return label;
 	}
 
@@ -143,7 +200,7 @@ class utree {
 		for(int i = start; i < label; i++) {
 			leaves[i] = NULL;
 		}
-		leaves[label] = new unode(label);
+		leaves[label] = node_storage.add(label);
 		return label;
 	}
 
@@ -194,6 +251,52 @@ class utree {
 		 }
 	 }
 
+	// make this tree a copy of T, with the nodes in one block in label
+	// order
+	void copy_nodes(const utree &T) {
+		int internal_nodes_size = T.internal_nodes.size();
+		int leaves_size = T.leaves.size();
+		internal_nodes.assign(internal_nodes_size, NULL);
+		leaves.assign(leaves_size, NULL);
+		smallest_leaf = T.smallest_leaf;
+		tracked_fingerprint = T.tracked_fingerprint;
+		fingerprint_tracked = T.fingerprint_tracked;
+		node_storage.clear();
+		node_storage.reserve(T.node_storage.size());
+		for(int i = 0; i < internal_nodes_size; i++) {
+			if (T.internal_nodes[i] != NULL) {
+				internal_nodes[i] = node_storage.add(*(T.internal_nodes[i]));
+			}
+		}
+		for(int i = 0; i < leaves_size; i++) {
+			if (T.leaves[i] != NULL) {
+				leaves[i] = node_storage.add(*(T.leaves[i]));
+			}
+		}
+		// the copied neighbors still point into T
+		for(int i = 0; i < internal_nodes_size; i++) {
+			if (internal_nodes[i] != NULL) {
+				relink_neighbors(internal_nodes[i]);
+			}
+		}
+		for(int i = 0; i < leaves_size; i++) {
+			if (leaves[i] != NULL) {
+				relink_neighbors(leaves[i]);
+			}
+		}
+	}
+
+	// point the neighbors of n, copied from another tree, to the nodes
+	// of this tree with the same labels
+	void relink_neighbors(unode *n) {
+		for (unode *&u : n->get_neighbors()) {
+			u = get_node(u->get_label());
+		}
+		for (unode *&u : n->get_contracted_neighbors()) {
+			u = get_node(u->get_label());
+		}
+	}
+
 	int num_leaves() const {
 		return leaves.size();
 	}
@@ -282,8 +385,6 @@ class utree {
 		if (print_internal_labels || n->get_label() >= 0) {
 			s << n->str(reverse_label_map);
 		}
-		list<unode *>::const_iterator i;
-		const list<unode *> &cn = n->const_neighbors();
 		int count = 0;
 		bool has_contracted = false;
 		for(unode *i : n->const_neighbors()) {
@@ -324,8 +425,6 @@ class utree {
 		if (print_internal_labels || n->get_label() >= 0) {
 			s << n->str(reverse_label_map);
 		}
-		list<unode *>::const_iterator i;
-		const list<unode *> &cn = n->const_neighbors();
 		int count = 0;
 		bool has_contracted = false;
 		for(unode *i : n->const_neighbors()) {
@@ -366,8 +465,6 @@ class utree {
 		if (print_internal_labels || n->get_label() >= 0) {
 			s << n->str();
 		}
-		list<unode *>::const_iterator i;
-		const list<unode *> &cn = n->const_neighbors();
 		int count = 0;
 		bool has_contracted = false;
 		for(unode *i : n->const_neighbors()) {
@@ -407,16 +504,102 @@ class utree {
 	void normalize_order() {
 		get_node(get_smallest_leaf())->get_parent()->normalize_order();
 	}
+
+	// append a compact encoding of the tree to encoding
+	// nodes are listed in preorder from the root used by str(), with leaves
+	// as their label and internal nodes as minus their number of children.
+	// The tree must be normalized; equal trees then have equal encodings
+	void encode(vector<int> &encoding) const {
+		if (smallest_leaf == -1) {
+			return;
+		}
+		unode *root = leaves[smallest_leaf]->get_parent();
+		encode_subtree(encoding, root, NULL);
+	}
+
+	void encode_subtree(vector<int> &encoding, unode *n, unode *prev) const {
+		if (n->get_label() >= 0) {
+			encoding.push_back(n->get_label());
+			return;
+		}
+		int children = n->get_num_neighbors();
+		if (prev != NULL) {
+			children--;
+		}
+		encoding.push_back(-children);
+		for (unode *c : n->const_neighbors()) {
+			if (c != prev) {
+				encode_subtree(encoding, c, n);
+			}
+		}
+	}
+
+	// canonical fingerprint of the topology, independent of branching order
+	tree_fingerprint fingerprint() const {
+		if (fingerprint_tracked) {
+			return tracked_fingerprint;
+		}
+		tree_fingerprint f = tree_fingerprint();
+		if (smallest_leaf == -1) {
+			return f;
+		}
+		unode *root = leaves[smallest_leaf];
+		fingerprint_hlpr(root, root->get_parent(), f);
+		return f;
+	}
 	void normalize_order(int n) {
 		get_node(n)->normalize_order();
 	}
 
+	// store the leaf sum below each node and keep the fingerprint up to
+	// date under uspr. This also normalizes the tree and uspr then keeps
+	// the parents and branching order normalized and repairs the distances
+	// of the nodes it moves. Other changes to the topology must call
+	// untrack_fingerprint()
+	void track_fingerprint() {
+		tracked_fingerprint = tree_fingerprint();
+		if (smallest_leaf != -1) {
+			unode *root = leaves[smallest_leaf];
+			root->set_clade(leaf_fingerprint(smallest_leaf));
+			root->set_min_descendant(smallest_leaf);
+			root->set_distance(0);
+			fingerprint_hlpr(root, root->get_parent(), tracked_fingerprint, true);
+		}
+		fingerprint_tracked = true;
+	}
+
+	void untrack_fingerprint() {
+		fingerprint_tracked = false;
+	}
+
+	bool is_fingerprint_tracked() const {
+		return fingerprint_tracked;
+	}
+
+	// apply a USPR operation and record how to revert it with undo_uspr
+	bool uspr(unode *x, unode *y, unode *w, unode *z, uspr_undo &undo) {
+		undo.x = x;
+		return uspr(x, y, w, z, &undo.y, &undo.y1, &undo.y2);
+	}
+
+	void undo_uspr(const uspr_undo &undo) {
+		uspr(undo.x, undo.y, undo.y1, undo.y2);
+	}
+
 	// apply a USPR operation moving (x,y) to (x,yprime) where yprime is adjacent to x, w, and z
 	bool uspr(unode *x, unode *y, unode *w, unode *z, unode **yprime = NULL, unode **y1 = NULL, unode **y2 = NULL) {
 		// y must have 3 neighbors
 		if (y->get_num_neighbors() != 3) {
 			return false;
 		}
+
+		// find the splits that change before the tree is modified
+		vector<pair<unode *, tree_fingerprint> > changed_clades = vector<pair<unode *, tree_fingerprint> >();
+		vector<pair<unode *, unode *> > new_parents = vector<pair<unode *, unode *> >();
+		vector<unode *> moved = vector<unode *>();
+		if (fingerprint_tracked) {
+			uspr_changes(x, y, w, z, changed_clades, new_parents, moved);
+		}
 		// remove (x,y)
 		x->remove_neighbor(y);
 		y->remove_neighbor(x);
@@ -455,15 +638,132 @@ class utree {
 			*yprime = y;
 		}
 
-		// cleanup the tree
-		// TODO: optional? this is probably slow
-//		unode *root = get_node(get_smallest_leaf());
-//		distances_from_leaf_decorator(this, root);
-//		normalize_order();
+		// repair the tree along the path instead of renormalizing it
+		if (fingerprint_tracked) {
+			for (size_t i = 0; i < new_parents.size(); i++) {
+				new_parents[i].first->rotate(new_parents[i].second->get_label());
+			}
+			for (unode *n : moved) {
+				n->set_distance(n->get_parent()->get_distance() + 1);
+			}
+			for (size_t i = 0; i < changed_clades.size(); i++) {
+				unode *n = changed_clades[i].first;
+				tracked_fingerprint.subtract(split_fingerprint(n->get_clade()));
+				tracked_fingerprint.add(split_fingerprint(changed_clades[i].second));
+				n->set_clade(changed_clades[i].second);
+				n->normalize_children();
+			}
+		}
 
 		return true;
 	}
-	
+
+	// the nodes affected by the uspr (x, y, w, z). Only the edges on the
+	// path between y and (w, z) change their splits. changed_clades holds
+	// the new leaf sums of the nodes whose children must be reordered,
+	// children first. moved holds the nodes with a new parent, parents
+	// first. Requires tracked leaf sums and parents
+	void uspr_changes(unode *x, unode *y, unode *w, unode *z,
+			vector<pair<unode *, tree_fingerprint> > &changed_clades,
+			vector<pair<unode *, unode *> > &new_parents,
+			vector<unode *> &moved) {
+		unode *root = leaves[smallest_leaf];
+		unode *upper = w;
+		unode *lower = z;
+		if (w != root && (z == root || z->get_parent() != w)) {
+			upper = z;
+			lower = w;
+		}
+		if (y->get_parent() != x) {
+			// the pruned subtree is below y so y's old ancestors lose it
+			// and the ancestors of (w, z) gain it, up to their common
+			// ancestor
+			unode *g = y->get_parent();
+			unode *q = y->get_neighbor_not(x, g);
+			tree_fingerprint pruned = x->get_clade();
+			vector<unode *> losing = vector<unode *>();
+			vector<unode *> gaining = vector<unode *>();
+			for (unode *n = g; n != root; n = n->get_parent()) {
+				losing.push_back(n);
+			}
+			for (unode *n = upper; n != root; n = n->get_parent()) {
+				if (n != y) {
+					gaining.push_back(n);
+				}
+			}
+			unode *common = NULL;
+			while (!losing.empty() && !gaining.empty() &&
+					losing.back() == gaining.back()) {
+				common = losing.back();
+				losing.pop_back();
+				gaining.pop_back();
+			}
+			tree_fingerprint lower_clade = lower->get_clade();
+			for (unode *n : losing) {
+				tree_fingerprint c = n->get_clade();
+				c.subtract(pruned);
+				changed_clades.push_back(make_pair(n, c));
+				if (n == lower) {
+					lower_clade = c;
+				}
+			}
+			tree_fingerprint y_clade = lower_clade;
+			y_clade.add(pruned);
+			changed_clades.push_back(make_pair(y, y_clade));
+			for (unode *n : gaining) {
+				tree_fingerprint c = n->get_clade();
+				c.add(pruned);
+				changed_clades.push_back(make_pair(n, c));
+			}
+			if (common != NULL) {
+				changed_clades.push_back(make_pair(common, common->get_clade()));
+			}
+
+			// g and upper keep their parents unless they are q or lower
+			new_parents.push_back(make_pair(g, g->get_parent()));
+			new_parents.push_back(make_pair(upper, upper->get_parent()));
+			new_parents.push_back(make_pair(q, g));
+			new_parents.push_back(make_pair(y, upper));
+			new_parents.push_back(make_pair(x, y));
+			moved.push_back(y);
+			moved.push_back(lower);
+			moved.push_back(x);
+			moved.push_back(q);
+		}
+		else {
+			// the pruned subtree contains the root so the subtree below y
+			// is rerooted at (w, z) and the path from w up to y reverses
+			vector<unode *> path = vector<unode *>();
+			for (unode *n = upper; n != y; n = n->get_parent()) {
+				path.push_back(n);
+			}
+			unode *q = y->get_neighbor_not(x, path.back());
+			tree_fingerprint c = q->get_clade();
+			new_parents.push_back(make_pair(x, x->get_parent()));
+			new_parents.push_back(make_pair(y, x));
+			new_parents.push_back(make_pair(q, path.back()));
+			for (int i = path.size() - 1; i >= 0; i--) {
+				unode *n = path[i];
+				unode *next = lower;
+				unode *parent = y;
+				if (i > 0) {
+					next = path[i-1];
+					parent = path[i-1];
+				}
+				tree_fingerprint old_next = next->get_clade();
+				c.add(n->get_clade());
+				c.subtract(old_next);
+				changed_clades.push_back(make_pair(n, c));
+				new_parents.push_back(make_pair(n, parent));
+			}
+			changed_clades.push_back(make_pair(y, y->get_clade()));
+			changed_clades.push_back(make_pair(x, x->get_clade()));
+			moved.push_back(lower);
+			moved.insert(moved.end(), path.begin(), path.end());
+			moved.push_back(q);
+		}
+		new_parents.push_back(make_pair(lower, y));
+	}
 };
 
 ostream& operator<<(ostream &os, const utree& t) {
@@ -491,6 +791,48 @@ bool build_utree(utree &t, string &s, map<string, int> *label_map, map<int, stri
 	return valid;
 }
 
+// rebuild a normalized tree from its encoding without parsing
+// internal labels are assigned in preorder as when parsing str() and
+// distances from the smallest leaf are set along the way
+void build_utree(utree &t, const int *encoding, int size) {
+	// stack of internal nodes and their number of missing children
+	vector<pair<unode *, int> > open_nodes = vector<pair<unode *, int> >();
+	int smallest_leaf = -1;
+	for (int i = 0; i < size; i++) {
+		int code = encoding[i];
+		unode *new_node;
+		if (code >= 0) {
+			new_node = t.get_leaf(t.add_leaf(code));
+			if (smallest_leaf == -1 || code < smallest_leaf) {
+				smallest_leaf = code;
+			}
+		}
+		else {
+			new_node = t.get_internal_node(t.add_internal_node());
+		}
+		if (open_nodes.empty()) {
+			new_node->set_distance(1);
+		}
+		else {
+			unode *parent = open_nodes.back().first;
+			new_node->set_distance(parent->get_distance() + 1);
+			new_node->add_neighbor(parent);
+			parent->add_neighbor(new_node);
+			open_nodes.back().second--;
+		}
+		if (code < 0) {
+			open_nodes.push_back(make_pair(new_node, -code));
+		}
+		while (!open_nodes.empty() && open_nodes.back().second == 0) {
+			open_nodes.pop_back();
+		}
+	}
+	t.set_smallest_leaf(smallest_leaf);
+	if (smallest_leaf != -1) {
+		t.get_leaf(smallest_leaf)->set_distance(0);
+	}
+}
+
 int build_utree_helper(utree &t, string &s, int start, unode *parent, bool &valid, map<string, int> *label_map, map<int, string> *reverse_label_map) {
 	// next special char
 	int loc = s.find_first_of("(,)", start);
@@ -596,4 +938,31 @@ void distances_from_leaf_decorator_hlpr(utree &T1, unode *prev, unode *current,
 	}
 }
 
+// add the split of each edge below (prev, current) to f
+// returns the leaf sum of the subtree rooted at current
+// if track is set, also store the leaf sum of each subtree and normalize it
+tree_fingerprint fingerprint_hlpr(unode *prev, unode *current, tree_fingerprint &f, bool track) {
+	tree_fingerprint leaf_sum = tree_fingerprint();
+	if (current->get_label() >= 0) {
+		leaf_sum = leaf_fingerprint(current->get_label());
+	}
+	if (track) {
+		current->set_distance(prev->get_distance() + 1);
+	}
+	for(unode *n : current->get_neighbors()) {
+		if (n != prev) {
+			leaf_sum.add(fingerprint_hlpr(current, n, f, track));
+		}
+	}
+	f.add(split_fingerprint(leaf_sum));
+	if (track) {
+		current->set_clade(leaf_sum);
+		if (current->get_parent() != prev) {
+			current->rotate(prev->get_label());
+		}
+		current->normalize_children();
+	}
+	return leaf_sum;
+}
+
 #endif